@@ -2,6 +2,338 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#ifdef RBTREE_HAVE_NUMA
+#include <numa.h>
+#endif
+
+#ifdef RBTREE_AUGMENT
+agg_t rbtree_agg_sum(agg_t a, agg_t b) { return a + b; }
+
+agg_t rbtree_agg_max(agg_t a, agg_t b) { return a > b ? a : b; }
+
+// tombstone의 값은 항등원으로 본다
+#define AGG_VALUE(t, x) ((x)->dead ? (t)->identity : (x)->value)
+
+// 자식의 agg로부터 x의 agg를 다시 계산
+void agg_update(rbtree *t, node_t *x) {
+  if (x == t->nil) {
+    return;
+  }
+  x->agg = t->combine(t->combine(x->left->agg, AGG_VALUE(t, x)), x->right->agg);
+}
+
+// x부터 루트까지 올라가며 agg를 갱신
+void agg_update_path(rbtree *t, node_t *x) {
+  while (x != t->nil) {
+    agg_update(t, x);
+    x = x->parent;
+  }
+}
+
+#define AGG_UPDATE(t, x) agg_update(t, x)
+#define AGG_UPDATE_PATH(t, x) agg_update_path(t, x)
+#else
+// augmentation이 없는 빌드에서는 아무 코드도 생성하지 않는다
+#define AGG_UPDATE(t, x) ((void)0)
+#define AGG_UPDATE_PATH(t, x) ((void)0)
+#endif
+
+// trace가 켜져 있을 때만 레코드를 남긴다
+#define TRACE(t, op, key)                                 \
+  do {                                                    \
+    if ((t)->ext != NULL && (t)->ext->trace != NULL) {    \
+      trace_record((t), (op), (key));                     \
+    }                                                     \
+  } while (0)
+
+void trace_record(const rbtree *t, const rbtree_op_t op, const key_t key) {
+  const rbtree_trace_rec rec = {op, key};
+  fwrite(&rec, sizeof(rec), 1, t->ext->trace);
+}
+
+// 자주 쓰지 않는 기능의 상태를 처음 쓸 때 할당한다. 실패하면 NULL
+rbtree_ext *ext_of(rbtree *t) {
+  if (t->ext == NULL) {
+    t->ext = (rbtree_ext *)calloc(1, sizeof(rbtree_ext));
+  }
+  return t->ext;
+}
+
+// 버퍼에 있는 노드 수
+size_t buffered_count(const rbtree *t) {
+  return t->ext != NULL ? t->ext->buf_n : 0;
+}
+
+// 배치 크기 * ratio가 트리 크기 이상이면 삽입 대신 트리를 다시 만든다
+#ifndef RBTREE_BATCH_REBUILD_RATIO
+#define RBTREE_BATCH_REBUILD_RATIO 4
+#endif
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+
+// 2MiB 경계에 맞춘 bytes 크기의 익명 메모리를 받아 huge page를 요청한다
+void *huge_page_map(const size_t bytes) {
+  // 정렬을 위해 한 페이지만큼 더 받은 뒤 앞뒤를 잘라낸다
+  const size_t len = bytes + HUGE_PAGE_SIZE;
+  char *raw = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (raw == MAP_FAILED) {
+    return NULL;
+  }
+
+  char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) &
+                           ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+  if (aligned > raw) {
+    munmap(raw, aligned - raw);
+  }
+  if (raw + len > aligned + bytes) {
+    munmap(aligned + bytes, raw + len - (aligned + bytes));
+  }
+
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+#ifdef RBTREE_HAVE_NUMA
+  // 페이지가 처음 쓰이기 전에 호출한 스레드의 NUMA 노드에 묶는다
+  if (numa_available() >= 0) {
+    numa_setlocal_memory(aligned, bytes);
+  }
+#endif
+  return aligned;
+}
+
+// huge page 모드에서 노드를 잘라 쓰는 block 하나의 노드 수 (2MiB에 맞춤)
+#define ARENA_NODES ((HUGE_PAGE_SIZE - sizeof(node_block)) / sizeof(node_t))
+
+// cap개의 노드가 들어가는 block을 할당해 트리에 붙인다
+// huge_page가 참이고 cap이 ARENA_NODES 이상이면 2MiB 단위의 huge page로 받는다.
+// 바이트 수가 아니라 노드 수로 비교하므로 node_t 크기가 2MiB를 나누지
+// 못해도 arena block은 항상 huge page 하나가 된다
+node_block *block_alloc(rbtree *t, const size_t cap, const int huge_page) {
+  size_t bytes = sizeof(node_block) + cap * sizeof(node_t);
+  node_block *b;
+
+  if (ext_of(t) == NULL) {
+    return NULL;
+  }
+
+  if (huge_page && cap >= ARENA_NODES) {
+    bytes = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    b = (node_block *)huge_page_map(bytes);
+  } else {
+    bytes = 0;
+    b = (node_block *)malloc(sizeof(node_block) + cap * sizeof(node_t));
+  }
+
+  if (b == NULL) {
+    return NULL;
+  }
+
+  b->cap = cap;
+  b->bytes = bytes;
+  b->used = 0;
+  b->next = t->ext->blocks;
+  t->ext->blocks = b;
+  return b;
+}
+
+void block_free(node_block *b) {
+  if (b->bytes > 0) {
+    munmap(b, b->bytes);
+  } else {
+    free(b);
+  }
+}
+
+// 노드 하나를 할당한다. block에서 반환된 노드가 있으면 재사용한다
+// huge page 모드면 마지막 block에서 잘라 쓰고, 다 쓰면 block을 새로 받는다
+node_t *node_alloc(rbtree *t) {
+  rbtree_ext *x = t->ext;
+  node_t *p = x != NULL ? x->free_nodes : NULL;
+
+  if (p == NULL) {
+    const int huge = x != NULL && x->huge_pages;
+    node_block *b = huge ? x->blocks : NULL;
+    if (huge && (b == NULL || b->used == b->cap)) {
+      b = block_alloc(t, ARENA_NODES, 1);
+    }
+    if (b != NULL) {
+      p = &b->nodes[b->used++];
+      memset(p, 0, sizeof(node_t));
+      p->in_block = 1;
+      return p;
+    }
+    // block을 받지 못하면 노드 단위로 할당한다
+    return (node_t *)calloc(1, sizeof(node_t));
+  }
+
+  // free_nodes에는 block 안의 노드만 있다
+  x->free_nodes = p->right;
+  memset(p, 0, sizeof(node_t));
+  p->in_block = 1;
+  return p;
+}
+
+int release_slot(rbtree *t, const node_t *p);
+
+// block 안의 노드는 free하지 않고 free_nodes에 모아 둔다
+// small 헤더의 slot은 헤더와 함께 반환된다
+void node_free(rbtree *t, node_t *p) {
+  // block 안의 노드가 있으면 ext도 있다
+  if (p->in_block) {
+    p->right = t->ext->free_nodes;
+    t->ext->free_nodes = p;
+    return;
+  }
+  if (release_slot(t, p)) {
+    return;
+  }
+
+  free(p);
+}
+
+#if RBTREE_SMALL_MAX > 255
+#error "RBTREE_SMALL_MAX must fit in an unsigned char slot index"
+#endif
+
+// small mode 헤더: 트리 헤더 뒤에 inline slot 배열이 붙어 있다
+// slot은 자리를 옮기지 않으므로 노드 포인터가 insert/erase 뒤에도 유효하다.
+// key 순서는 order의 앞 size개가, 빈 slot은 나머지가 가리킨다.
+// pool에 있는 동안에는 헤더 자리에 다음 빈 헤더를 연결한다
+typedef struct small_rbtree {
+  union {
+    rbtree t;
+    struct small_rbtree *next_free;
+  };
+  node_t slots[RBTREE_SMALL_MAX];
+  unsigned char order[RBTREE_SMALL_MAX];
+  unsigned char slot_nodes;  // 승격 뒤 트리에 남아 있는 slot 노드 수
+} small_rbtree;
+
+// 헤더는 SMALL_POOL_CHUNK개씩 한 번에 할당해서 pool에 넣어 둔다
+#define SMALL_POOL_CHUNK 64
+
+typedef struct small_chunk {
+  struct small_chunk *next;
+  small_rbtree trees[SMALL_POOL_CHUNK];
+} small_chunk;
+
+// 모든 small 트리가 공유하므로 트리 연산은 small_nil에 쓰지 않는다
+static node_t small_nil = {.color = RBTREE_BLACK};
+static small_rbtree *small_pool;
+static small_chunk *small_chunks;
+static pthread_mutex_t small_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// pool에서 받은 헤더는 공유 sentinel을 쓴다
+int is_pooled(const rbtree *t) { return t->nil == &small_nil; }
+
+small_rbtree *small_of(const rbtree *t) { return (small_rbtree *)t; }
+
+// key 순서로 i번째 slot
+node_t *small_at(const rbtree *t, const size_t i) {
+  return &t->small[small_of(t)->order[i]];
+}
+
+// p가 헤더의 slot이면 p를 따로 free하지 않도록 1을 반환한다
+int release_slot(rbtree *t, const node_t *p) {
+  if (!is_pooled(t)) {
+    return 0;
+  }
+  small_rbtree *s = small_of(t);
+  if (p < s->slots || p >= s->slots + RBTREE_SMALL_MAX) {
+    return 0;
+  }
+  s->slot_nodes--;
+  return 1;
+}
+
+void rebuild_from_nodes(rbtree *t, node_t **nodes, const size_t n);
+int rbtree_relayout(rbtree *t);
+
+rbtree *new_small_rbtree(void) {
+  pthread_mutex_lock(&small_pool_lock);
+  if (small_pool == NULL) {
+    small_chunk *chunk = (small_chunk *)malloc(sizeof(small_chunk));
+    if (chunk == NULL) {
+      pthread_mutex_unlock(&small_pool_lock);
+      return NULL;
+    }
+    chunk->next = small_chunks;
+    small_chunks = chunk;
+    for (int i = 0; i < SMALL_POOL_CHUNK; i++) {
+      chunk->trees[i].next_free = small_pool;
+      small_pool = &chunk->trees[i];
+    }
+  }
+
+  small_rbtree *s = small_pool;
+  small_pool = s->next_free;
+  pthread_mutex_unlock(&small_pool_lock);
+  memset(s, 0, sizeof(small_rbtree));
+
+  rbtree *t = &s->t;
+  t->nil = &small_nil;
+  t->root = &small_nil;
+  t->small = s->slots;
+  for (int i = 0; i < RBTREE_SMALL_MAX; i++) {
+    s->order[i] = i;
+  }
+#ifdef RBTREE_AUGMENT
+  t->combine = rbtree_agg_sum;
+  t->identity = small_nil.agg;
+#endif
+  return t;
+}
+
+// 배열에서 key보다 큰 첫 위치 (같은 key는 뒤에 삽입)
+size_t small_upper(const rbtree *t, const key_t key) {
+  size_t i = 0;
+
+  while (i < t->size && small_at(t, i)->key <= key) {
+    i++;
+  }
+  return i;
+}
+
+// 빈 slot 하나에 key를 넣고 order에서 그 자리를 끼워 넣는다
+node_t *small_insert(rbtree *t, const key_t key) {
+  unsigned char *order = small_of(t)->order;
+  const size_t i = small_upper(t, key);
+  const unsigned char slot = order[t->size];
+  node_t *p = &t->small[slot];
+
+  memmove(order + i + 1, order + i, t->size - i);
+  order[i] = slot;
+  memset(p, 0, sizeof(node_t));
+  p->key = key;
+  p->color = RBTREE_BLACK;
+  p->parent = p->left = p->right = t->nil;
+#ifdef RBTREE_AUGMENT
+  p->value = p->agg = t->identity;
+#endif
+  t->size++;
+  return p;
+}
+
+// 배열이 가득 차면 실제 RB tree로 옮긴다. 이미 정렬되어 있으므로 O(n)
+// slot을 그대로 트리 노드로 쓰므로 이미 반환한 포인터도 유효하다
+void small_promote(rbtree *t) {
+  node_t *nodes[RBTREE_SMALL_MAX];
+  const size_t n = t->size;
+
+  for (size_t i = 0; i < n; i++) {
+    nodes[i] = small_at(t, i);
+  }
+
+  small_of(t)->slot_nodes = n;
+  t->small = NULL;
+  rebuild_from_nodes(t, nodes, n);
+}
 
 // 새로운 트리 생성
 rbtree *new_rbtree(void) {
@@ -15,8 +347,15 @@ rbtree *new_rbtree(void) {
 
   p->nil = nil_node;
   nil_node->color = RBTREE_BLACK;
+  nil_node->dead = 0;
   p->root = nil_node;
 
+#ifdef RBTREE_AUGMENT
+  p->combine = rbtree_agg_sum;
+  p->identity = 0;
+  nil_node->value = nil_node->agg = p->identity;
+#endif
+
   return p;
 }
 
@@ -27,7 +366,10 @@ void search_delete(rbtree *t, node_t *node) {
 
   search_delete(t, node->left);
   search_delete(t, node->right);
-  free(node);
+  // block 안의 노드는 block과 함께, slot은 헤더와 함께 반환된다
+  if (!node->in_block && !release_slot(t, node)) {
+    free(node);
+  }
   node = NULL;
 }
 
@@ -36,9 +378,43 @@ void delete_rbtree(rbtree *t) {
     return;
   }
 
+  // 반환값으로 알릴 수 없으므로 trace가 잘렸으면 stderr에 남긴다
+  if (rbtree_trace_stop(t) != 0) {
+    fprintf(stderr, "rbtree: trace file is incomplete\n");
+  }
+
+  rbtree_ext *x = t->ext;
+  if (x != NULL) {
+    for (size_t i = 0; i < x->buf_n; i++) {
+      node_free(t, x->buf[i]);
+    }
+    free(x->buf);
+  }
+
   if (t->root != t->nil) {
     search_delete(t, t->root);
   }
+
+  if (x != NULL) {
+    while (x->blocks != NULL) {
+      node_block *next = x->blocks->next;
+      block_free(x->blocks);
+      x->blocks = next;
+    }
+    free(x);
+    t->ext = NULL;
+  }
+
+  // small 헤더는 pool로 돌려보내고 공유 sentinel은 free하지 않는다
+  if (is_pooled(t)) {
+    small_rbtree *s = (small_rbtree *)t;
+    pthread_mutex_lock(&small_pool_lock);
+    s->next_free = small_pool;
+    small_pool = s;
+    pthread_mutex_unlock(&small_pool_lock);
+    return;
+  }
+
   free(t->nil);
   t->nil = NULL;
   free(t);
@@ -68,6 +444,9 @@ void left_rotate(rbtree *t, node_t *x) {
 
   y->left = x;
   x->parent = y;
+
+  AGG_UPDATE(t, x);
+  AGG_UPDATE(t, y);
 }
 
 // 오른쪽으로 회전
@@ -93,6 +472,9 @@ void right_rotate(rbtree *t, node_t *x) {
 
   y->right = x;
   x->parent = y;
+
+  AGG_UPDATE(t, x);
+  AGG_UPDATE(t, y);
 }
 
 // 삽입 이후에 fix
@@ -159,13 +541,14 @@ void rb_insert_fixup(rbtree *t, node_t *node) {
   // t->root->parent = t->nil;
 }
 
-node_t *rbtree_insert(rbtree *t, const key_t key) {
-  node_t *parent, *curr, *new_node;
+// from의 서브트리에서 자리를 찾아 new_node를 연결하고 fixup
+// from이 루트가 아니라면 new_node의 key가 from 서브트리의 범위 안에 있어야 한다
+void link_node(rbtree *t, node_t *from, node_t *new_node) {
+  node_t *parent, *curr;
+  const key_t key = new_node->key;
 
   parent = t->nil;
-  curr = t->root;
-
-  new_node = (node_t *)calloc(1, sizeof(node_t));
+  curr = from;
 
   while (curr != t->nil) {
     parent = curr;
@@ -192,19 +575,142 @@ node_t *rbtree_insert(rbtree *t, const key_t key) {
     parent->right = new_node;
   }
 
-  new_node->key = key;
   new_node->color = RBTREE_RED;
   new_node->left = t->nil;
   new_node->right = t->nil;
+#ifdef RBTREE_AUGMENT
+  // 항등원이므로 조상들의 agg는 바뀌지 않는다
+  new_node->value = new_node->agg = t->identity;
+#endif
+  t->size++;
   rb_insert_fixup(t, new_node);
+}
 
-  return t->root;
+// 새 노드를 만들어 삽입하고 그 노드를 반환
+node_t *insert_node(rbtree *t, const key_t key) {
+  if (t->small != NULL) {
+    if (t->size < RBTREE_SMALL_MAX) {
+      return small_insert(t, key);
+    }
+    small_promote(t);
+  }
+
+  node_t *new_node = node_alloc(t);
+
+  new_node->key = key;
+  link_node(t, t->root, new_node);
+
+  return new_node;
+}
+
+// churn이 많이 쌓였으면 노드를 다시 배치한다
+void maybe_relayout(rbtree *t) {
+  rbtree_ext *x = t->ext;
+
+  if (x == NULL || x->relayout_ratio <= 0) {
+    return;
+  }
+  x->churn++;
+  if (x->churn > x->relayout_ratio * t->size) {
+    rbtree_relayout(t);
+  }
+}
+
+// 새 노드를 버퍼 끝에 붙이고 버퍼가 가득 차면 트리에 합친다 (amortized O(1))
+node_t *buffer_insert(rbtree *t, const key_t key) {
+  rbtree_ext *x = t->ext;
+  node_t *p = node_alloc(t);
+
+  p->key = key;
+  p->color = RBTREE_RED;
+  p->parent = p->left = p->right = t->nil;
+  p->buffered = 1;
+#ifdef RBTREE_AUGMENT
+  p->value = p->agg = t->identity;
+#endif
+
+  x->buf[x->buf_n++] = p;
+  t->size++;
+
+  if (x->buf_n == x->buf_cap) {
+    rbtree_flush_buffer(t);
+  }
+  return p;
+}
+
+// 버퍼는 정렬되어 있지 않으므로 마지막 노드를 p의 자리로 옮긴다
+void buffer_remove(rbtree *t, node_t *p) {
+  rbtree_ext *x = t->ext;
+  size_t i = 0;
+
+  while (x->buf[i] != p) {
+    i++;
+  }
+  x->buf[i] = x->buf[--x->buf_n];
+}
+
+node_t *rbtree_insert(rbtree *t, const key_t key) {
+  TRACE(t, RBTREE_OP_INSERT, key);
+
+  // 버퍼를 쓰면 fixup 없이 버퍼에 넣고 새 노드를 반환한다
+  // 이전 flush가 실패해 버퍼가 가득 차 있으면 다시 합쳐 본다
+  rbtree_ext *x = t->ext;
+  if (x != NULL && x->buf_cap > 0 && t->small == NULL &&
+      (x->buf_n < x->buf_cap || rbtree_flush_buffer(t) == 0)) {
+    // 반환할 노드가 옮겨지지 않도록 삽입 전에 relayout한다
+    maybe_relayout(t);
+    return buffer_insert(t, key);
+  }
+
+  // 반환할 노드가 옮겨지지 않도록 삽입 전에 relayout한다
+  maybe_relayout(t);
+  return insert_node(t, key);
+}
+
+// p 서브트리에서 tombstone이 아닌 key 노드를 찾는다
+// 같은 key는 양쪽 서브트리에 모두 있을 수 있다
+node_t *find_live(const rbtree *t, node_t *p, const key_t key) {
+  while (p != t->nil) {
+    if (p->key < key) {
+      p = p->right;
+    } else if (p->key > key) {
+      p = p->left;
+    } else if (!p->dead) {
+      return p;
+    } else {
+      node_t *q = find_live(t, p->left, key);
+      if (q != NULL) {
+        return q;
+      }
+      p = p->right;
+    }
+  }
+
+  return NULL;
 }
 
 // key에 해당하는 node를 반환
 node_t *rbtree_find(const rbtree *t, const key_t key) {
   node_t *curr = t->root;
 
+  TRACE(t, RBTREE_OP_FIND, key);
+
+  if (t->small != NULL) {
+    for (size_t i = 0; i < t->size; i++) {
+      if (small_at(t, i)->key == key) {
+        return small_at(t, i);
+      }
+    }
+    return NULL;
+  }
+
+  // 버퍼는 cap개 이하이므로 처음부터 훑는다
+  for (size_t i = 0; i < buffered_count(t); i++) {
+    if (t->ext->buf[i]->key == key) {
+      return t->ext->buf[i];
+    }
+  }
+
   // 루트의 값이 nil이 아닐 때까지 탐색한다
   while (curr != t->nil && curr != NULL) {
     // 루트의 값이 찾고자하는 키의 값보다 작다
@@ -218,19 +724,65 @@ node_t *rbtree_find(const rbtree *t, const key_t key) {
       curr = curr->left;
     }
     // 루트의 값이 찾고자 하는 값이다
+    // tombstone이면 같은 key를 가진 다른 노드를 찾는다
     else {
-      return curr;
+      return curr->dead ? find_live(t, curr, key) : curr;
     }
   }
 
   return NULL;
 }
 
+// 중위 순회에서 다음 노드, 없으면 NULL
+node_t *node_next(const rbtree *t, node_t *p) {
+  if (p->right != t->nil) {
+    p = p->right;
+    while (p->left != t->nil) {
+      p = p->left;
+    }
+    return p;
+  }
+
+  while (p->parent != t->nil && p == p->parent->right) {
+    p = p->parent;
+  }
+  return p->parent == t->nil ? NULL : p->parent;
+}
+
+// 중위 순회에서 이전 노드, 없으면 NULL
+node_t *node_prev(const rbtree *t, node_t *p) {
+  if (p->left != t->nil) {
+    p = p->left;
+    while (p->right != t->nil) {
+      p = p->right;
+    }
+    return p;
+  }
+
+  while (p->parent != t->nil && p == p->parent->left) {
+    p = p->parent;
+  }
+  return p->parent == t->nil ? NULL : p->parent;
+}
+
 node_t *rbtree_min(const rbtree *t) {
   node_t *curr = t->root;
 
+  TRACE(t, RBTREE_OP_MIN, 0);
+
+  if (t->small != NULL) {
+    return t->size > 0 ? small_at(t, 0) : NULL;
+  }
+
+  node_t *buffered = NULL;
+  for (size_t i = 0; i < buffered_count(t); i++) {
+    if (buffered == NULL || t->ext->buf[i]->key < buffered->key) {
+      buffered = t->ext->buf[i];
+    }
+  }
+
   if (curr == t->nil) {
-    return NULL;
+    return buffered;
   }
 
   // 그 다음 왼쪽 자식이 없다.(즉 해당 Curr 노드가 가장 작은 노드이다)
@@ -238,14 +790,36 @@ node_t *rbtree_min(const rbtree *t) {
     curr = curr->left;
   }
 
+  // tombstone은 건너뛴다
+  while (curr != NULL && curr->dead) {
+    curr = node_next(t, curr);
+  }
+
+  // 버퍼의 최솟값과 비교한다
+  if (buffered != NULL && (curr == NULL || buffered->key < curr->key)) {
+    return buffered;
+  }
   return curr;
 }
 
 node_t *rbtree_max(const rbtree *t) {
   node_t *curr = t->root;
 
+  TRACE(t, RBTREE_OP_MAX, 0);
+
+  if (t->small != NULL) {
+    return t->size > 0 ? small_at(t, t->size - 1) : NULL;
+  }
+
+  node_t *buffered = NULL;
+  for (size_t i = 0; i < buffered_count(t); i++) {
+    if (buffered == NULL || t->ext->buf[i]->key > buffered->key) {
+      buffered = t->ext->buf[i];
+    }
+  }
+
   if (curr == t->nil) {
-    return NULL;
+    return buffered;
   }
 
   // 그 다음 오른쪽 자식이 없다.(즉 해당 Curr 노드가 가장 큰 노드이다)
@@ -253,6 +827,15 @@ node_t *rbtree_max(const rbtree *t) {
     curr = curr->right;
   }
 
+  // tombstone은 건너뛴다
+  while (curr != NULL && curr->dead) {
+    curr = node_prev(t, curr);
+  }
+
+  // 버퍼의 최댓값과 비교한다
+  if (buffered != NULL && (curr == NULL || buffered->key > curr->key)) {
+    return buffered;
+  }
   return curr;
 }
 
@@ -294,6 +877,8 @@ node_t *find_child(rbtree *t, node_t *curr) {
   }
 }
 
+// sentinel은 여러 트리가 공유할 수 있으므로 replaced_node가 nil이면
+// parent를 쓰지 않는다. 호출한 쪽에서 부모를 따로 기억한다
 void transplant(rbtree *t, node_t *deleted_node, node_t *replaced_node) {
   // case1. 바꾸기 전의 노드가 루트 노드
   if (deleted_node->parent == t->nil) {
@@ -310,10 +895,13 @@ void transplant(rbtree *t, node_t *deleted_node, node_t *replaced_node) {
     deleted_node->parent->right = replaced_node;
   }
 
-  replaced_node->parent = deleted_node->parent;
+  if (replaced_node != t->nil) {
+    replaced_node->parent = deleted_node->parent;
+  }
 }
 
-void rb_erase_fixup(rbtree *t, node_t *curr) {
+// curr가 nil일 수 있으므로 부모는 parent로 따로 받는다
+void rb_erase_fixup(rbtree *t, node_t *curr, node_t *parent) {
   node_t *sibiling;
   while (curr != t->root && curr->color == RBTREE_BLACK) {
     // 루트 노드라면
@@ -329,16 +917,16 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
     // }
 
     // doubly black이 부모의 왼쪽 노드일 때
-    if (curr == curr->parent->left) {
-      sibiling = curr->parent->right;
+    if (curr == parent->left) {
+      sibiling = parent->right;
 
       // case1
       if (sibiling->color == RBTREE_RED) {
         sibiling->color = RBTREE_BLACK;
-        curr->parent->color = RBTREE_RED;
+        parent->color = RBTREE_RED;
 
-        left_rotate(t, curr->parent);
-        sibiling = curr->parent->right;
+        left_rotate(t, parent);
+        sibiling = parent->right;
       }
 
       // case 2,3,4를 해결한다
@@ -347,7 +935,8 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
       if (sibiling->left->color == RBTREE_BLACK &&
           sibiling->right->color == RBTREE_BLACK) {
         sibiling->color = RBTREE_RED;
-        curr = curr->parent;
+        curr = parent;
+        parent = curr->parent;
       }
 
       // case3
@@ -357,16 +946,16 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
           sibiling->color = RBTREE_RED;
 
           right_rotate(t, sibiling);
-          sibiling = curr->parent->right;
+          sibiling = parent->right;
         }
 
         // case4
-        sibiling->color = curr->parent->color;
-        curr->parent->color = RBTREE_BLACK;
+        sibiling->color = parent->color;
+        parent->color = RBTREE_BLACK;
         sibiling->right->color = RBTREE_BLACK;
 
         // 부모를 기준으로 왼쪽 회전
-        left_rotate(t, curr->parent);
+        left_rotate(t, parent);
 
         curr = t->root;
       }
@@ -374,15 +963,15 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
 
     // doubly black이 부모의 오른쪽 노드일 때
     else {
-      sibiling = curr->parent->left;
+      sibiling = parent->left;
 
       // case1
       if (sibiling->color == RBTREE_RED) {
         sibiling->color = RBTREE_BLACK;
-        curr->parent->color = RBTREE_RED;
+        parent->color = RBTREE_RED;
 
-        right_rotate(t, curr->parent);
-        sibiling = curr->parent->left;
+        right_rotate(t, parent);
+        sibiling = parent->left;
       }
 
       // case2,3,4를 해결한다.
@@ -391,7 +980,8 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
       if (sibiling->left->color == RBTREE_BLACK &&
           sibiling->right->color == RBTREE_BLACK) {
         sibiling->color = RBTREE_RED;
-        curr = curr->parent;
+        curr = parent;
+        parent = curr->parent;
       }
 
       // case3
@@ -401,29 +991,73 @@ void rb_erase_fixup(rbtree *t, node_t *curr) {
           sibiling->color = RBTREE_RED;
 
           left_rotate(t, sibiling);
-          sibiling = curr->parent->left;
+          sibiling = parent->left;
         }
 
         // case4
-        sibiling->color = curr->parent->color;
-        curr->parent->color = RBTREE_BLACK;
+        sibiling->color = parent->color;
+        parent->color = RBTREE_BLACK;
         sibiling->left->color = RBTREE_BLACK;
 
         // 부모를 기준으로 왼쪽 회전
-        right_rotate(t, curr->parent);
+        right_rotate(t, parent);
 
         curr = t->root;
       }
     }
   }
-  curr->color = RBTREE_BLACK;
+  if (curr != t->nil) {
+    curr->color = RBTREE_BLACK;
+  }
 }
 
 int rbtree_erase(rbtree *t, node_t *p) {
-  if (p == NULL || p == t->nil) {
+  if (p == NULL || p == t->nil || p->dead) {
     return -1;
   }
+
+  TRACE(t, RBTREE_OP_ERASE, p->key);
+
+  // small mode는 order에서 빼고 slot을 빈 slot 쪽으로 돌려놓는다
+  // 이미 지운 slot을 가리키는 포인터는 거부한다
+  if (t->small != NULL) {
+    unsigned char *order = small_of(t)->order;
+    size_t i = 0;
+    while (i < t->size && &t->small[order[i]] != p) {
+      i++;
+    }
+    if (i == t->size) {
+      return -1;
+    }
+    const unsigned char slot = order[i];
+    memmove(order + i, order + i + 1, t->size - i - 1);
+    order[--t->size] = slot;
+    return 0;
+  }
+
+  // 버퍼의 노드는 트리에 연결되어 있지 않으므로 빼기만 한다
+  if (p->buffered) {
+    buffer_remove(t, p);
+    t->size--;
+    node_free(t, p);
+    return 0;
+  }
+
+  // lazy erase: 표시만 해 두고 tombstone이 많아지면 한 번에 정리한다
+  rbtree_ext *ext = t->ext;
+  if (ext != NULL && ext->max_dead_ratio > 0) {
+    p->dead = 1;
+    ext->dead++;
+    AGG_UPDATE_PATH(t, p);
+    if (ext->dead > ext->max_dead_ratio * t->size) {
+      rbtree_compact(t);
+    }
+    maybe_relayout(t);
+    return 0;
+  }
+
   node_t *x;
+  node_t *x_parent = p->parent;  // x가 nil이어도 쓸 수 있는 x의 부모
   node_t *y = p;
   color_t y_original_color = y->color;
 
@@ -446,9 +1080,10 @@ int rbtree_erase(rbtree *t, node_t *p) {
 
     if (y->parent == p)  // 후임자의 부모노드가 삭제하려는 노드일 때
     {
-      x->parent = y;  //
-    } else            // if (y -> parent != p)
+      x_parent = y;
+    } else  // if (y -> parent != p)
     {
+      x_parent = y->parent;
       transplant(t, y, y->right);
       y->right = p->right;
       y->right->parent = y;
@@ -460,15 +1095,20 @@ int rbtree_erase(rbtree *t, node_t *p) {
     y->color = p->color;
   }
 
+  // x의 부모부터 위쪽은 서브트리 구성이 바뀌었다
+  AGG_UPDATE_PATH(t, x_parent);
+
   if (y_original_color == RBTREE_BLACK) {
-    rb_erase_fixup(t, x);
+    rb_erase_fixup(t, x, x_parent);
   }
 
   if (t->root == p) {
     t->root = x;
   }
 
-  free(p);
+  t->size--;
+  node_free(t, p);
+  maybe_relayout(t);
 
   return 0;
 }
@@ -479,13 +1119,727 @@ int inorder_search(const rbtree *t, node_t *p, int idx, key_t *arr, int n) {
   }
 
   idx = inorder_search(t, p->left, idx, arr, n);
-  arr[idx++] = p->key;
+  if (!p->dead && idx < n) {
+    arr[idx++] = p->key;
+  }
   idx = inorder_search(t, p->right, idx, arr, n);
   return idx;
 }
 
+int key_compare(const void *p1, const void *p2) {
+  const key_t a = *(const key_t *)p1;
+  const key_t b = *(const key_t *)p2;
+  return (a > b) - (a < b);
+}
+
+int node_key_compare(const void *p1, const void *p2) {
+  const key_t a = (*(node_t *const *)p1)->key;
+  const key_t b = (*(node_t *const *)p2)->key;
+  return (a > b) - (a < b);
+}
+
 int rbtree_to_array(const rbtree *t, key_t *arr, const size_t n) {
-  inorder_search(t, t->root, 0, arr, n);
-  printf("\n");
+  TRACE(t, RBTREE_OP_TO_ARRAY, n > INT32_MAX ? INT32_MAX : (key_t)n);
+
+  if (t->small != NULL) {
+    for (size_t i = 0; i < t->size && i < n; i++) {
+      arr[i] = small_at(t, i)->key;
+    }
+    return 0;
+  }
+
+  // 버퍼의 key는 복사해서 정렬한다 (읽기 연산이므로 버퍼는 건드리지 않는다)
+  size_t j = buffered_count(t);
+  key_t *buffered = NULL;
+  if (j > 0) {
+    buffered = (key_t *)malloc(j * sizeof(key_t));
+    if (buffered == NULL) {
+      return -1;
+    }
+    for (size_t i = 0; i < j; i++) {
+      buffered[i] = t->ext->buf[i]->key;
+    }
+    qsort(buffered, j, sizeof(key_t), key_compare);
+  }
+
+  size_t k = inorder_search(t, t->root, 0, arr, n);
+
+  // 트리의 key들과 버퍼를 뒤에서부터 합친다. 앞의 n개만 쓴다
+  size_t pos = k + j;
+  while (j > 0) {
+    const key_t key =
+        k > 0 && arr[k - 1] > buffered[j - 1] ? arr[--k] : buffered[--j];
+    if (--pos < n) {
+      arr[pos] = key;
+    }
+  }
+  free(buffered);
   return 0;
-}
\ No newline at end of file
+}
+
+// 중위 순회 순서대로 노드 포인터를 모은다
+size_t collect_nodes(const rbtree *t, node_t *p, node_t **arr, size_t idx) {
+  if (p == t->nil) {
+    return idx;
+  }
+
+  idx = collect_nodes(t, p->left, arr, idx);
+  arr[idx++] = p;
+  return collect_nodes(t, p->right, arr, idx);
+}
+
+// 정렬된 nodes[lo, hi)로 균형 잡힌 서브트리를 만든다
+// red_depth 깊이(마지막 불완전 레벨)의 노드만 빨간색이라 black height가 같다
+node_t *build_balanced(rbtree *t, node_t **nodes, size_t lo, size_t hi,
+                       node_t *parent, int depth, int red_depth) {
+  if (lo >= hi) {
+    return t->nil;
+  }
+
+  size_t mid = lo + (hi - lo) / 2;
+  node_t *p = nodes[mid];
+
+  p->parent = parent;
+  p->left = build_balanced(t, nodes, lo, mid, p, depth + 1, red_depth);
+  p->right = build_balanced(t, nodes, mid + 1, hi, p, depth + 1, red_depth);
+  p->color = depth == red_depth ? RBTREE_RED : RBTREE_BLACK;
+  AGG_UPDATE(t, p);
+  return p;
+}
+
+// 정렬된 노드 배열 전체로 트리를 다시 만든다 O(n)
+void rebuild_from_nodes(rbtree *t, node_t **nodes, const size_t n) {
+  int red_depth = 0;
+
+  // 2^red_depth - 1 <= n < 2^(red_depth + 1) - 1
+  while (((size_t)2 << red_depth) - 1 <= n) {
+    red_depth++;
+  }
+
+  t->root = build_balanced(t, nodes, 0, n, t->nil, 0, red_depth);
+  t->size = n;
+}
+
+// 직전에 삽입한 last 노드에서 위로 올라가며
+// key가 들어갈 수 있는 가장 낮은 서브트리를 찾는다 (key >= last->key)
+node_t *finger_start(rbtree *t, node_t *last, const key_t key) {
+  node_t *curr = last;
+
+  while (curr->parent != t->nil) {
+    // 왼쪽 자식이면 부모의 key가 서브트리의 상한이다
+    if (curr == curr->parent->left && key < curr->parent->key) {
+      return curr;
+    }
+    curr = curr->parent;
+  }
+
+  return curr;
+}
+
+// 정렬된 노드들을 트리에 합친다
+// 트리에 비해 배치가 크면 전체를 다시 만들고, 작으면 finger로 이어서 삽입한다
+int insert_sorted_nodes(rbtree *t, node_t **nodes, const size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+
+  if (n * RBTREE_BATCH_REBUILD_RATIO >= t->size) {
+    const size_t total = t->size + n;
+    node_t **old = (node_t **)malloc((t->size + 1) * sizeof(node_t *));
+    node_t **merged = (node_t **)malloc(total * sizeof(node_t *));
+
+    if (old == NULL || merged == NULL) {
+      free(old);
+      free(merged);
+      return -1;
+    }
+
+    const size_t m = collect_nodes(t, t->root, old, 0);
+    size_t i = 0, j = 0, k = 0;
+
+    while (i < m || j < n) {
+      if (i < m && old[i]->dead) {
+        // 다시 만드는 김에 tombstone을 정리한다
+        node_free(t, old[i++]);
+      } else if (i == m || (j < n && nodes[j]->key < old[i]->key)) {
+        merged[k++] = nodes[j++];
+      } else {
+        merged[k++] = old[i++];
+      }
+    }
+
+#ifdef RBTREE_AUGMENT
+    for (j = 0; j < n; j++) {
+      nodes[j]->value = t->identity;
+    }
+#endif
+    if (t->ext != NULL) {
+      t->ext->dead = 0;
+    }
+    rebuild_from_nodes(t, merged, k);
+    free(merged);
+    free(old);
+    return 0;
+  }
+
+  link_node(t, t->root, nodes[0]);
+  for (size_t i = 1; i < n; i++) {
+    link_node(t, finger_start(t, nodes[i - 1], nodes[i]->key), nodes[i]);
+  }
+  return 0;
+}
+
+// keys를 정렬한 뒤 한 번에 트리에 합친다
+int rbtree_insert_batch(rbtree *t, const key_t *keys, const size_t n) {
+  if (n == 0) {
+    return 0;
+  }
+
+  if (t->ext != NULL && t->ext->trace != NULL) {
+    // 레코드 하나에 담을 수 있도록 INT32_MAX개씩 나누어 기록
+    for (size_t i = 0; i < n; i++) {
+      if (i % INT32_MAX == 0) {
+        const size_t left = n - i;
+        trace_record(t, RBTREE_OP_BATCH,
+                     left > INT32_MAX ? INT32_MAX : (key_t)left);
+      }
+      trace_record(t, RBTREE_OP_BATCH_KEY, keys[i]);
+    }
+  }
+
+  if (rbtree_flush_buffer(t) != 0) {
+    return -1;
+  }
+
+  if (t->small != NULL) {
+    if (t->size + n <= RBTREE_SMALL_MAX) {
+      for (size_t i = 0; i < n; i++) {
+        small_insert(t, keys[i]);
+      }
+      return 0;
+    }
+    small_promote(t);
+  }
+
+  key_t *sorted = (key_t *)malloc(n * sizeof(key_t));
+  node_t **nodes = (node_t **)malloc(n * sizeof(node_t *));
+
+  if (sorted == NULL || nodes == NULL) {
+    free(sorted);
+    free(nodes);
+    return -1;
+  }
+
+  memcpy(sorted, keys, n * sizeof(key_t));
+  qsort(sorted, n, sizeof(key_t), key_compare);
+
+  for (size_t i = 0; i < n; i++) {
+    nodes[i] = node_alloc(t);
+    nodes[i]->key = sorted[i];
+  }
+
+  int ret = insert_sorted_nodes(t, nodes, n);
+  if (ret != 0) {
+    for (size_t i = 0; i < n; i++) {
+      node_free(t, nodes[i]);
+    }
+  }
+
+  free(nodes);
+  free(sorted);
+  return ret;
+}
+
+// tombstone을 모두 free하고 남은 노드로 트리를 다시 만든다 O(n)
+int rbtree_compact(rbtree *t) {
+  if (t->ext == NULL || t->ext->dead == 0) {
+    return 0;
+  }
+
+  if (rbtree_flush_buffer(t) != 0) {
+    return -1;
+  }
+  if (t->ext->dead == 0) {
+    return 0;
+  }
+
+  node_t **nodes = (node_t **)malloc(t->size * sizeof(node_t *));
+  if (nodes == NULL) {
+    return -1;
+  }
+
+  const size_t m = collect_nodes(t, t->root, nodes, 0);
+  size_t k = 0;
+
+  for (size_t i = 0; i < m; i++) {
+    if (nodes[i]->dead) {
+      node_free(t, nodes[i]);
+    } else {
+      nodes[k++] = nodes[i];
+    }
+  }
+
+  t->ext->dead = 0;
+  rebuild_from_nodes(t, nodes, k);
+  free(nodes);
+  return 0;
+}
+
+// tombstone 비율이 max_dead_ratio를 넘으면 compact한다. 0이면 lazy erase 끔
+int rbtree_set_lazy_erase(rbtree *t, const double max_dead_ratio) {
+  if (max_dead_ratio <= 0) {
+    if (t->ext != NULL) {
+      t->ext->max_dead_ratio = 0;
+    }
+    return rbtree_compact(t);
+  }
+
+  if (ext_of(t) == NULL) {
+    return -1;
+  }
+  t->ext->max_dead_ratio = max_dead_ratio;
+  return 0;
+}
+
+// p 서브트리를 전위 순회 순서대로 nodes[*idx]부터 복사한다
+node_t *clone_nodes(const rbtree *t, const rbtree *c, node_t *p,
+                    node_t *parent, node_t *nodes, size_t *idx) {
+  if (p == t->nil) {
+    return c->nil;
+  }
+
+  node_t *q = &nodes[(*idx)++];
+
+  *q = *p;
+  q->in_block = 1;
+  q->parent = parent;
+  q->left = clone_nodes(t, c, p->left, q, nodes, idx);
+  q->right = clone_nodes(t, c, p->right, q, nodes, idx);
+  return q;
+}
+
+// 모양과 색을 그대로 복사한 트리를 만든다
+// 회전, fixup 없이 한 번의 순회로 하나의 block에 복사한다 O(n)
+rbtree *rbtree_clone(const rbtree *t) {
+  const rbtree_ext *x = t->ext;
+  rbtree *c = is_pooled(t) ? new_small_rbtree() : new_rbtree();
+
+  if (c == NULL) {
+    return NULL;
+  }
+
+  // 이미 승격된 small 트리는 헤더만 pool에서 받고 일반 트리로 복사한다
+  if (t->small == NULL) {
+    c->small = NULL;
+  }
+
+  // lazy erase, huge page, 버퍼 설정을 복사한다 (trace, relayout은 제외)
+  if (x != NULL && (rbtree_set_lazy_erase(c, x->max_dead_ratio) != 0 ||
+                    rbtree_set_huge_pages(c, x->huge_pages) != 0 ||
+                    rbtree_set_insert_buffer(c, x->buf_cap) != 0)) {
+    delete_rbtree(c);
+    return NULL;
+  }
+
+  // small 트리는 같은 sentinel을 쓰므로 배열을 그대로 복사하면 된다
+  if (t->small != NULL) {
+    memcpy(c->small, t->small, RBTREE_SMALL_MAX * sizeof(node_t));
+    memcpy(small_of(c)->order, small_of(t)->order, RBTREE_SMALL_MAX);
+    c->size = t->size;
+#ifdef RBTREE_AUGMENT
+    c->combine = t->combine;
+    c->identity = t->identity;
+#endif
+    return c;
+  }
+
+#ifdef RBTREE_AUGMENT
+  rbtree_set_aggregate(c, t->combine, t->identity);
+#endif
+
+  const size_t tree_size = t->size - buffered_count(t);
+
+  if (tree_size > 0) {
+    node_block *b = block_alloc(c, tree_size, 1);
+    if (b == NULL) {
+      delete_rbtree(c);
+      return NULL;
+    }
+
+    size_t idx = 0;
+    b->used = tree_size;
+    c->root = clone_nodes(t, c, t->root, c->nil, b->nodes, &idx);
+    c->size = tree_size;
+    c->ext->dead = x != NULL ? x->dead : 0;
+  }
+
+  // 버퍼의 key는 같은 크기의 버퍼로 다시 넣는다
+  for (size_t i = 0; i < buffered_count(t); i++) {
+    buffer_insert(c, x->buf[i]->key);
+  }
+  return c;
+}
+
+// 모든 노드를 huge page로 받은 하나의 block에 BFS 순서로 옮긴다 O(n)
+// 위쪽 레벨들이 같은 cache line, 같은 페이지에 모인다.
+// 트리의 내용과 모양은 그대로지만 노드 포인터는 모두 바뀐다.
+int rbtree_relayout(rbtree *t) {
+  // 버퍼의 노드도 옮겨지도록 먼저 트리에 합친다
+  if (rbtree_flush_buffer(t) != 0) {
+    return -1;
+  }
+  if (t->size == 0 || t->small != NULL) {
+    return 0;
+  }
+
+  rbtree_ext *x = ext_of(t);
+  if (x == NULL) {
+    return -1;
+  }
+  x->churn = 0;
+
+  node_t **order = (node_t **)malloc(t->size * sizeof(node_t *));
+  if (order == NULL) {
+    return -1;
+  }
+
+  // order 자체를 BFS 큐로 쓴다
+  size_t head = 0, tail = 0;
+  order[tail++] = t->root;
+  while (head < tail) {
+    node_t *p = order[head++];
+    if (p->left != t->nil) {
+      order[tail++] = p->left;
+    }
+    if (p->right != t->nil) {
+      order[tail++] = p->right;
+    }
+  }
+
+  node_block *old_blocks = x->blocks;
+  x->blocks = NULL;
+  node_block *b = block_alloc(t, tail, 1);
+  if (b == NULL) {
+    x->blocks = old_blocks;
+    free(order);
+    return -1;
+  }
+
+  // 큐에 넣은 순서대로 자식의 새 위치가 정해진다
+  b->used = tail;
+  node_t *nodes = b->nodes;
+  size_t next = 1;
+  for (size_t i = 0; i < tail; i++) {
+    node_t *p = order[i];
+    node_t *q = &nodes[i];
+    // 부모는 먼저 처리되면서 이미 q->parent를 채워 두었다
+    node_t *parent = i == 0 ? t->nil : q->parent;
+
+    *q = *p;
+    q->in_block = 1;
+    q->parent = parent;
+    if (p->left != t->nil) {
+      q->left = &nodes[next];
+      nodes[next++].parent = q;
+    }
+    if (p->right != t->nil) {
+      q->right = &nodes[next];
+      nodes[next++].parent = q;
+    }
+  }
+
+  // 따로 할당된 노드만 free하고 기존 block은 통째로 반환한다
+  for (size_t i = 0; i < tail; i++) {
+    if (!order[i]->in_block && !release_slot(t, order[i])) {
+      free(order[i]);
+    }
+  }
+  while (old_blocks != NULL) {
+    node_block *ob_next = old_blocks->next;
+    block_free(old_blocks);
+    old_blocks = ob_next;
+  }
+
+  x->free_nodes = NULL;
+  t->root = &nodes[0];
+  free(order);
+  return 0;
+}
+
+// insert/erase가 size * churn_ratio번 쌓일 때마다 자동으로 relayout한다
+// 0이면 끈다. relayout이 일어나면 이전에 받은 노드 포인터는 무효가 된다.
+int rbtree_set_auto_relayout(rbtree *t, const double churn_ratio) {
+  if (churn_ratio <= 0 && t->ext == NULL) {
+    return 0;
+  }
+  if (ext_of(t) == NULL) {
+    return -1;
+  }
+  t->ext->relayout_ratio = churn_ratio;
+  t->ext->churn = 0;
+  return 0;
+}
+
+// 버퍼의 노드들을 한 번의 배치로 트리에 합친다. 노드 포인터는 그대로 유효하다
+int rbtree_flush_buffer(rbtree *t) {
+  const size_t n = buffered_count(t);
+  rbtree_ext *x = t->ext;
+
+  if (n == 0) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    x->buf[i]->buffered = 0;
+  }
+
+  // 버퍼는 삽입 순서대로 쌓이므로 합치기 전에 한 번 정렬한다
+  qsort(x->buf, n, sizeof(node_t *), node_key_compare);
+
+  // insert_sorted_nodes는 size를 트리의 노드 개수로 본다
+  x->buf_n = 0;
+  t->size -= n;
+  if (insert_sorted_nodes(t, x->buf, n) != 0) {
+    for (size_t i = 0; i < n; i++) {
+      x->buf[i]->buffered = 1;
+    }
+    x->buf_n = n;
+    t->size += n;
+    return -1;
+  }
+  return 0;
+}
+
+// cap이 0이면 버퍼를 끈다. 버퍼에 남은 노드는 먼저 트리에 합친다
+int rbtree_set_insert_buffer(rbtree *t, const size_t cap) {
+  if (rbtree_flush_buffer(t) != 0) {
+    return -1;
+  }
+
+  if (cap == 0 && t->ext == NULL) {
+    return 0;
+  }
+  rbtree_ext *x = ext_of(t);
+  if (x == NULL) {
+    return -1;
+  }
+
+  if (cap == 0) {
+    free(x->buf);
+    x->buf = NULL;
+  } else {
+    node_t **buf = (node_t **)realloc(x->buf, cap * sizeof(node_t *));
+    if (buf == NULL) {
+      return -1;
+    }
+    x->buf = buf;
+  }
+
+  x->buf_cap = cap;
+  return 0;
+}
+
+// 켜면 이후의 노드를 2MiB huge page block에서 잘라 쓴다
+// 이미 할당된 노드는 그대로 두므로 옮기려면 rbtree_relayout을 호출한다
+int rbtree_set_huge_pages(rbtree *t, const int on) {
+  if (!on && t->ext == NULL) {
+    return 0;
+  }
+  if (ext_of(t) == NULL) {
+    return -1;
+  }
+  t->ext->huge_pages = on;
+  return 0;
+}
+
+// 트리가 가진 메모리를 센다. malloc 자체의 헤더는 포함하지 않는다
+rbtree_memory rbtree_memory_usage(const rbtree *t) {
+  const rbtree_ext *x = t->ext;
+  rbtree_memory m = {0};
+  size_t in_blocks = 0;
+
+  m.reserved_bytes = is_pooled(t) ? sizeof(small_rbtree)
+                                  : sizeof(rbtree) + sizeof(node_t);
+  if (x != NULL) {
+    m.reserved_bytes += sizeof(rbtree_ext) + x->buf_cap * sizeof(node_t *);
+  }
+
+  if (t->small != NULL) {
+    m.live_nodes = t->size;
+    m.used_bytes = t->size * sizeof(node_t);
+    m.fragmentation = 1.0 - (double)m.used_bytes / m.reserved_bytes;
+    return m;
+  }
+
+  for (const node_block *b = x != NULL ? x->blocks : NULL; b != NULL;
+       b = b->next) {
+    const size_t bytes =
+        b->bytes > 0 ? b->bytes : sizeof(node_block) + b->cap * sizeof(node_t);
+    m.reserved_bytes += bytes;
+    if (b->bytes > 0) {
+      m.huge_page_bytes += bytes;
+    }
+    in_blocks += b->used;
+  }
+
+  for (const node_t *p = x != NULL ? x->free_nodes : NULL; p != NULL;
+       p = p->right) {
+    m.free_nodes++;
+  }
+
+  // block 밖에서 노드 단위로 할당된 노드 (헤더의 slot은 이미 셌다)
+  const size_t in_header = is_pooled(t) ? small_of(t)->slot_nodes : 0;
+  const size_t in_use_in_blocks = in_blocks - m.free_nodes;
+  if (t->size > in_use_in_blocks + in_header) {
+    m.reserved_bytes +=
+        (t->size - in_use_in_blocks - in_header) * sizeof(node_t);
+  }
+
+  m.dead_nodes = x != NULL ? x->dead : 0;
+  m.live_nodes = t->size - m.dead_nodes;
+  m.used_bytes = t->size * sizeof(node_t);
+  m.fragmentation = 1.0 - (double)m.used_bytes / m.reserved_bytes;
+  return m;
+}
+
+// 이후의 연산을 path 파일에 기록한다. 이미 기록 중이면 먼저 닫는다
+int rbtree_trace_start(rbtree *t, const char *path) {
+  rbtree_trace_stop(t);
+
+  FILE *fp = fopen(path, "wb");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  setvbuf(fp, NULL, _IOFBF, 1 << 20);
+  if (fwrite(RBTREE_TRACE_MAGIC, 1, 8, fp) != 8 || ext_of(t) == NULL) {
+    fclose(fp);
+    return -1;
+  }
+
+  t->ext->trace = fp;
+  return 0;
+}
+
+// 기록을 끝내고 파일을 닫는다. 쓰기에 한 번이라도 실패했으면 -1
+// trace_record는 fwrite 실패를 확인하지 않으므로 여기서 ferror로 확인한다
+int rbtree_trace_stop(rbtree *t) {
+  rbtree_ext *x = t->ext;
+
+  if (x == NULL || x->trace == NULL) {
+    return 0;
+  }
+
+  int ret = ferror(x->trace) ? -1 : 0;
+  if (fclose(x->trace) != 0) {
+    ret = -1;
+  }
+  x->trace = NULL;
+  return ret;
+}
+
+#ifdef RBTREE_AUGMENT
+node_t *rbtree_insert_value(rbtree *t, const key_t key, const agg_t value) {
+  TRACE(t, RBTREE_OP_INSERT, key);
+  // 반환할 노드가 옮겨지지 않도록 삽입 전에 relayout한다
+  maybe_relayout(t);
+  node_t *p = insert_node(t, key);
+
+  // fixup 이후의 위치에서 루트까지 다시 갱신
+  p->value = value;
+  agg_update_path(t, p);
+  return p;
+}
+
+void agg_recompute(rbtree *t, node_t *p) {
+  if (p == t->nil) {
+    return;
+  }
+  agg_recompute(t, p->left);
+  agg_recompute(t, p->right);
+  agg_update(t, p);
+}
+
+// combine을 바꾸면 모든 서브트리의 agg를 다시 계산한다 O(n)
+int rbtree_set_aggregate(rbtree *t, agg_combine_t combine,
+                         const agg_t identity) {
+  // 공유 sentinel의 agg는 모든 small 트리가 같이 쓰므로 바꿀 수 없다
+  if (t->nil == &small_nil && identity != small_nil.agg) {
+    return -1;
+  }
+
+  t->combine = combine;
+  t->identity = identity;
+  if (!is_pooled(t)) {
+    t->nil->value = t->nil->agg = identity;
+  }
+  agg_recompute(t, t->root);
+  return 0;
+}
+
+// key >= lo 인 노드들의 combine
+agg_t agg_from(const rbtree *t, node_t *p, const key_t lo) {
+  agg_t res = t->identity;
+
+  while (p != t->nil) {
+    if (p->key >= lo) {
+      // p와 오른쪽 서브트리 전체가 범위에 포함된다
+      res = t->combine(res, t->combine(AGG_VALUE(t, p), p->right->agg));
+      p = p->left;
+    } else {
+      p = p->right;
+    }
+  }
+  return res;
+}
+
+// key <= hi 인 노드들의 combine
+agg_t agg_until(const rbtree *t, node_t *p, const key_t hi) {
+  agg_t res = t->identity;
+
+  while (p != t->nil) {
+    if (p->key <= hi) {
+      // p와 왼쪽 서브트리 전체가 범위에 포함된다
+      res = t->combine(res, t->combine(p->left->agg, AGG_VALUE(t, p)));
+      p = p->right;
+    } else {
+      p = p->left;
+    }
+  }
+  return res;
+}
+
+// [lo, hi] 범위에 있는 key들의 value를 combine한 값 O(log n)
+agg_t rbtree_range_aggregate(const rbtree *t, const key_t lo,
+                             const key_t hi) {
+  node_t *curr = t->root;
+
+  if (lo > hi) {
+    return t->identity;
+  }
+
+  if (t->small != NULL) {
+    agg_t acc = t->identity;
+    for (size_t i = 0; i < t->size && small_at(t, i)->key <= hi; i++) {
+      if (small_at(t, i)->key >= lo) {
+        acc = t->combine(acc, small_at(t, i)->value);
+      }
+    }
+    return acc;
+  }
+
+  // 범위가 갈라지는 노드를 찾는다
+  while (curr != t->nil) {
+    if (curr->key < lo) {
+      curr = curr->right;
+    } else if (curr->key > hi) {
+      curr = curr->left;
+    } else {
+      return t->combine(
+          t->combine(agg_from(t, curr->left, lo), AGG_VALUE(t, curr)),
+          agg_until(t, curr->right, hi));
+    }
+  }
+  return t->identity;
+}
+#endif
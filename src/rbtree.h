@@ -2,25 +2,117 @@
 #define _RBTREE_H_
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 typedef enum { RBTREE_RED, RBTREE_BLACK } color_t;
 
 typedef int key_t;
 
+#ifdef RBTREE_AUGMENT
+typedef long long agg_t;
+typedef agg_t (*agg_combine_t)(agg_t, agg_t);
+#endif
+
 typedef struct node_t {
-  color_t color;
+  color_t color : 1;
+  unsigned int dead : 1;      // lazy erase로 지워진 노드 (tombstone)
+  unsigned int buffered : 1;  // 아직 트리에 합쳐지지 않은 insert 버퍼의 노드
+  unsigned int in_block : 1;  // node_block 안의 노드 (따로 free하지 않는다)
   key_t key;
   struct node_t *parent, *left, *right;
+#ifdef RBTREE_AUGMENT
+  agg_t value;  // 노드에 딸린 값
+  agg_t agg;    // 서브트리 전체의 value를 combine한 값
+#endif
 } node_t;
 
+// 여러 노드를 한 번에 할당한 연속된 메모리
+// 헤더가 32바이트라 노드가 cache line 경계에 걸치지 않는다
+typedef struct node_block {
+  struct node_block *next;
+  size_t cap;
+  size_t bytes;   // mmap으로 받은 경우 그 크기, malloc이면 0
+  size_t used;    // 잘라 쓴 노드 수 (헤더를 32바이트로 맞추는 역할도 한다)
+  node_t nodes[];
+} node_block;
+
+// trace에 기록되는 연산 종류
+typedef enum {
+  RBTREE_OP_INSERT,
+  RBTREE_OP_FIND,
+  RBTREE_OP_ERASE,  // key: 지운 노드의 key
+  RBTREE_OP_MIN,
+  RBTREE_OP_MAX,
+  RBTREE_OP_TO_ARRAY,  // key: 배열 크기 n
+  RBTREE_OP_BATCH,     // key: 뒤따르는 RBTREE_OP_BATCH_KEY 개수
+  RBTREE_OP_BATCH_KEY,
+} rbtree_op_t;
+
+// trace 파일은 RBTREE_TRACE_MAGIC 뒤에 8바이트 레코드가 이어진다
+#define RBTREE_TRACE_MAGIC "RBTRACE1"
+
+typedef struct {
+  int32_t op;
+  int32_t key;
+} rbtree_trace_rec;
+
+// new_small_rbtree로 만든 트리는 key가 이 개수를 넘을 때까지
+// 헤더 안의 slot 배열에 저장한다
+#ifndef RBTREE_SMALL_MAX
+#define RBTREE_SMALL_MAX 8
+#endif
+
+// 대부분의 트리는 쓰지 않는 기능의 상태
+// 기능을 처음 켤 때 할당하므로 그 전까지 트리 헤더에는 포인터 하나만 든다
+typedef struct {
+  size_t dead;            // tombstone 개수
+  double max_dead_ratio;  // 0이면 바로 삭제, 아니면 lazy erase
+  node_block *blocks;     // 트리가 소유한 노드 block들
+  node_t *free_nodes;     // block에서 반환되어 재사용할 노드 (right로 연결)
+  FILE *trace;            // NULL이 아니면 연산을 기록한다
+  size_t churn;           // 마지막 relayout 이후 insert/erase 횟수
+  double relayout_ratio;  // churn이 size * ratio를 넘으면 relayout, 0이면 끔
+  node_t **buf;           // 삽입 순서대로 쌓는 insert 버퍼 (size에 포함)
+  size_t buf_n;
+  size_t buf_cap;         // 0이면 버퍼를 쓰지 않는다
+  int huge_pages;         // 노드를 huge page block에서 할당한다
+} rbtree_ext;
+
 typedef struct {
   node_t *root;
-  node_t *nil;  // for sentinel
+  node_t *nil;      // for sentinel
+  size_t size;      // 노드 개수 (tombstone 포함)
+  node_t *small;    // small mode의 inline slot 배열, 아니면 NULL
+  rbtree_ext *ext;  // 위의 기능을 하나도 쓰지 않으면 NULL
+#ifdef RBTREE_AUGMENT
+  agg_combine_t combine;  // 결합법칙, 교환법칙이 성립해야 함
+  agg_t identity;         // combine의 항등원 (nil의 agg)
+#endif
 } rbtree;
 
+// rbtree_memory_usage의 결과
+typedef struct {
+  size_t live_nodes;       // 트리와 버퍼의 노드 (tombstone 제외)
+  size_t dead_nodes;       // tombstone
+  size_t free_nodes;       // block 안에서 재사용을 기다리는 노드
+  size_t reserved_bytes;   // 헤더, sentinel, block, 버퍼를 포함해 잡아 둔 바이트
+  size_t used_bytes;       // live, dead 노드가 차지하는 바이트
+  size_t huge_page_bytes;  // reserved 중 huge page로 요청한 바이트
+  double fragmentation;    // 1 - used / reserved
+} rbtree_memory;
+
 rbtree *new_rbtree(void);
 void delete_rbtree(rbtree *);
 
+// 작은 트리를 많이 만들 때 사용한다. 헤더는 mutex로 보호되는 전역 pool에서
+// 받고 sentinel은 모든 small 트리가 공유한다 (트리 연산은 sentinel에 쓰지
+// 않는다). 서로 다른 트리는 일반 트리처럼 여러 스레드에서 동시에 써도 된다.
+// slot은 옮겨지지 않으므로 노드 포인터는 일반 트리처럼 그 노드를 지울
+// 때까지 유효하다 (일반 트리로 승격된 뒤에도 같다).
+rbtree *new_small_rbtree(void);
+
+// 새로 삽입한 노드를 반환한다 (small mode, insert 버퍼에서도 같다)
 node_t *rbtree_insert(rbtree *, const key_t);
 node_t *rbtree_find(const rbtree *, const key_t);
 node_t *rbtree_min(const rbtree *);
@@ -29,4 +121,36 @@ int rbtree_erase(rbtree *, node_t *);
 
 int rbtree_to_array(const rbtree *, key_t *, const size_t);
 
+int rbtree_insert_batch(rbtree *, const key_t *, const size_t);
+
+int rbtree_set_lazy_erase(rbtree *, const double);
+int rbtree_compact(rbtree *);
+
+rbtree *rbtree_clone(const rbtree *);
+
+int rbtree_relayout(rbtree *);
+int rbtree_set_auto_relayout(rbtree *, const double);
+
+// rbtree_insert를 cap개까지 버퍼에 모았다가 한 번에 트리에 합친다
+// 버퍼에 넣는 것은 amortized O(1)이고 flush할 때 한 번 정렬한다 O(cap log cap).
+// 대신 버퍼를 쓰는 동안 find/min/max는 버퍼도 훑으므로 O(log n + cap)이다
+int rbtree_set_insert_buffer(rbtree *, const size_t);
+int rbtree_flush_buffer(rbtree *);
+
+// RBTREE_HAVE_NUMA로 빌드하면 huge page block을 할당한 스레드의 NUMA 노드에 묶는다
+int rbtree_set_huge_pages(rbtree *, const int);
+rbtree_memory rbtree_memory_usage(const rbtree *);
+
+int rbtree_trace_start(rbtree *, const char *);
+int rbtree_trace_stop(rbtree *);
+
+#ifdef RBTREE_AUGMENT
+agg_t rbtree_agg_sum(agg_t, agg_t);
+agg_t rbtree_agg_max(agg_t, agg_t);
+
+node_t *rbtree_insert_value(rbtree *, const key_t, const agg_t);
+int rbtree_set_aggregate(rbtree *, agg_combine_t, const agg_t);
+agg_t rbtree_range_aggregate(const rbtree *, const key_t, const key_t);
+#endif
+
 #endif  // _RBTREE_H_
@@ -0,0 +1,215 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rbtree.h"
+
+// rbtree_trace_start로 기록한 trace를 새 트리에 그대로 다시 수행하고
+// 연산 종류별 소요 시간을 출력한다.
+// usage: replay <trace file> [lazy erase ratio]
+
+#define OP_COUNT (RBTREE_OP_BATCH_KEY + 1)
+#define HIST_BUCKETS 40                // 2^i ns 단위 히스토그램
+#define WINDOW_BYTES ((size_t)64 << 20)  // 이만큼 읽을 때마다 페이지를 반환
+
+static const char *op_names[OP_COUNT] = {
+    "insert", "find", "erase", "min", "max", "to_array", "batch", "batch_key",
+};
+
+typedef struct {
+  size_t count;
+  double total_ns;
+  double max_ns;
+  size_t hist[HIST_BUCKETS];
+} op_stat;
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void stat_add(op_stat *s, const double ns) {
+  int b = 0;
+
+  while (b < HIST_BUCKETS - 1 && ((size_t)1 << b) < ns) {
+    b++;
+  }
+  s->hist[b]++;
+  s->count++;
+  s->total_ns += ns;
+  if (ns > s->max_ns) {
+    s->max_ns = ns;
+  }
+}
+
+// 히스토그램에서 q 분위수의 상한 (ns)
+static size_t stat_quantile(const op_stat *s, const double q) {
+  size_t seen = 0;
+
+  for (int b = 0; b < HIST_BUCKETS; b++) {
+    seen += s->hist[b];
+    if (seen >= q * s->count) {
+      return (size_t)1 << b;
+    }
+  }
+  return (size_t)1 << (HIST_BUCKETS - 1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <trace file> [lazy erase ratio]\n", argv[0]);
+    return 1;
+  }
+
+  int fd = open(argv[1], O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  const size_t len = st.st_size;
+  if (len < 8) {
+    fprintf(stderr, "%s: not a trace file\n", argv[1]);
+    return 1;
+  }
+
+  unsigned char *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+  madvise(data, len, MADV_SEQUENTIAL);
+
+  if (memcmp(data, RBTREE_TRACE_MAGIC, 8) != 0) {
+    fprintf(stderr, "%s: not a trace file\n", argv[1]);
+    return 1;
+  }
+
+  rbtree *t = new_rbtree();
+  if (argc > 2) {
+    rbtree_set_lazy_erase(t, atof(argv[2]));
+  }
+
+  op_stat stats[OP_COUNT];
+  memset(stats, 0, sizeof(stats));
+
+  key_t *arr = NULL;
+  size_t arr_cap = 0;
+  size_t released = 0;
+  size_t off = 8;
+  size_t unknown = 0;
+
+  while (off + sizeof(rbtree_trace_rec) <= len) {
+    rbtree_trace_rec rec;
+    memcpy(&rec, data + off, sizeof(rec));
+    off += sizeof(rec);
+
+    double start = now_ns();
+
+    switch (rec.op) {
+      case RBTREE_OP_INSERT:
+        rbtree_insert(t, rec.key);
+        break;
+      case RBTREE_OP_FIND:
+        rbtree_find(t, rec.key);
+        break;
+      case RBTREE_OP_ERASE:
+        // 노드 포인터 대신 key로 기록되어 있으므로 find가 포함된 시간이다
+        rbtree_erase(t, rbtree_find(t, rec.key));
+        break;
+      case RBTREE_OP_MIN:
+        rbtree_min(t);
+        break;
+      case RBTREE_OP_MAX:
+        rbtree_max(t);
+        break;
+      case RBTREE_OP_TO_ARRAY:
+        // 음수 크기는 손상된 레코드로 보고 건너뛴다
+        if (rec.key < 0) {
+          unknown++;
+          continue;
+        }
+        if ((size_t)rec.key > arr_cap) {
+          free(arr);
+          arr = calloc(rec.key, sizeof(key_t));
+          if (arr == NULL) {
+            fprintf(stderr,
+                    "to_array of %d keys at offset %zu: out of memory\n",
+                    rec.key, off - sizeof(rec));
+            return 1;
+          }
+          arr_cap = rec.key;
+        }
+        rbtree_to_array(t, arr, rec.key);
+        break;
+      case RBTREE_OP_BATCH: {
+        // 뒤따르는 key들은 trace 안에서 연속되어 있다
+        if (rec.key < 0) {
+          unknown++;
+          continue;
+        }
+        const size_t n = rec.key;
+        if (off + n * sizeof(rbtree_trace_rec) > len) {
+          off = len;
+          continue;
+        }
+        key_t *keys = malloc(n * sizeof(key_t));
+        if (keys == NULL) {
+          fprintf(stderr, "batch of %zu keys at offset %zu: out of memory\n",
+                  n, off - sizeof(rec));
+          return 1;
+        }
+        for (size_t i = 0; i < n; i++) {
+          rbtree_trace_rec key_rec;
+          memcpy(&key_rec, data + off + i * sizeof(key_rec), sizeof(key_rec));
+          keys[i] = key_rec.key;
+        }
+        off += n * sizeof(rbtree_trace_rec);
+        start = now_ns();
+        rbtree_insert_batch(t, keys, n);
+        free(keys);
+        break;
+      }
+      default:
+        unknown++;
+        continue;
+    }
+
+    stat_add(&stats[rec.op], now_ns() - start);
+
+    // 이미 읽은 부분은 페이지 캐시에서 내려 메모리 사용량을 일정하게 둔다
+    if (off - released >= WINDOW_BYTES) {
+      const size_t upto = off & ~(WINDOW_BYTES - 1);
+      madvise(data + released, upto - released, MADV_DONTNEED);
+      released = upto;
+    }
+  }
+
+  printf("%-10s %12s %10s %10s %10s %12s\n", "op", "count", "avg_ns",
+         "p50_ns<=", "p99_ns<=", "max_ns");
+  for (int op = 0; op < OP_COUNT; op++) {
+    const op_stat *s = &stats[op];
+    if (s->count == 0) {
+      continue;
+    }
+    printf("%-10s %12zu %10.0f %10zu %10zu %12.0f\n", op_names[op], s->count,
+           s->total_ns / s->count, stat_quantile(s, 0.5),
+           stat_quantile(s, 0.99), s->max_ns);
+  }
+  if (unknown > 0) {
+    printf("skipped %zu unknown or corrupt records\n", unknown);
+  }
+
+  free(arr);
+  delete_rbtree(t);
+  munmap(data, len);
+  return 0;
+}
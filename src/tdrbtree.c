@@ -0,0 +1,266 @@
+#include "tdrbtree.h"
+
+#include <stdlib.h>
+
+// 삽입과 삭제 모두 루트에서 한 번만 내려가면서 회전과 색 변경을 끝낸다.
+// 다시 올라갈 일이 없으므로 노드에 parent 포인터가 필요 없다.
+
+tdrbtree *new_tdrbtree(void) {
+  return (tdrbtree *)calloc(1, sizeof(tdrbtree));
+}
+
+static void td_delete_nodes(td_node_t *node) {
+  if (node == NULL) {
+    return;
+  }
+
+  td_delete_nodes(node->child[0]);
+  td_delete_nodes(node->child[1]);
+  free(node);
+}
+
+void delete_tdrbtree(tdrbtree *t) {
+  if (t == NULL) {
+    return;
+  }
+
+  td_delete_nodes(t->root);
+  free(t);
+}
+
+static int is_red(const td_node_t *node) {
+  return node != NULL && node->color == RBTREE_RED;
+}
+
+// root를 dir 방향으로 회전하고 새 서브트리 루트를 반환
+static td_node_t *rotate_single(td_node_t *root, const int dir) {
+  td_node_t *save = root->child[!dir];
+
+  root->child[!dir] = save->child[dir];
+  save->child[dir] = root;
+
+  root->color = RBTREE_RED;
+  save->color = RBTREE_BLACK;
+
+  return save;
+}
+
+static td_node_t *rotate_double(td_node_t *root, const int dir) {
+  root->child[!dir] = rotate_single(root->child[!dir], !dir);
+  return rotate_single(root, dir);
+}
+
+// 새로운 노드의 포인터를 반환
+td_node_t *tdrbtree_insert(tdrbtree *t, const key_t key) {
+  td_node_t *new_node = (td_node_t *)calloc(1, sizeof(td_node_t));
+
+  if (new_node == NULL) {
+    return NULL;
+  }
+
+  new_node->key = key;
+  new_node->color = RBTREE_RED;
+  t->size++;
+
+  if (t->root == NULL) {
+    t->root = new_node;
+    t->root->color = RBTREE_BLACK;
+    return new_node;
+  }
+
+  // head: 루트의 부모 역할을 하는 가짜 노드
+  td_node_t head = {RBTREE_BLACK, 0, {NULL, NULL}};
+  td_node_t *great = &head;  // 증조부모
+  td_node_t *grand = NULL;   // 조부모
+  td_node_t *parent = NULL;
+  td_node_t *curr = t->root;
+  int dir = 0, last = 0;
+
+  head.child[1] = t->root;
+
+  while (1) {
+    if (curr == NULL) {
+      // 빈 자리에 도착하면 새로운 노드를 연결한다
+      parent->child[dir] = curr = new_node;
+    } else if (is_red(curr->child[0]) && is_red(curr->child[1])) {
+      // 두 자식이 모두 빨간색이면 미리 색을 뒤집는다
+      curr->color = RBTREE_RED;
+      curr->child[0]->color = RBTREE_BLACK;
+      curr->child[1]->color = RBTREE_BLACK;
+    }
+
+    // 빨간색이 연속되면 조부모를 기준으로 회전한다
+    if (is_red(curr) && is_red(parent)) {
+      const int dir2 = great->child[1] == grand;
+
+      if (curr == parent->child[last]) {
+        great->child[dir2] = rotate_single(grand, !last);
+      } else {
+        great->child[dir2] = rotate_double(grand, !last);
+      }
+    }
+
+    if (curr == new_node) {
+      break;
+    }
+
+    // rbtree_insert와 같이 같은 key는 오른쪽으로 보낸다
+    last = dir;
+    dir = !(key < curr->key);
+
+    if (grand != NULL) {
+      great = grand;
+    }
+    grand = parent;
+    parent = curr;
+    curr = curr->child[dir];
+  }
+
+  t->root = head.child[1];
+  t->root->color = RBTREE_BLACK;
+
+  return new_node;
+}
+
+td_node_t *tdrbtree_find(const tdrbtree *t, const key_t key) {
+  td_node_t *curr = t->root;
+
+  while (curr != NULL) {
+    if (curr->key == key) {
+      return curr;
+    }
+    curr = curr->child[curr->key < key];
+  }
+
+  return NULL;
+}
+
+td_node_t *tdrbtree_min(const tdrbtree *t) {
+  td_node_t *curr = t->root;
+
+  if (curr == NULL) {
+    return NULL;
+  }
+
+  while (curr->child[0] != NULL) {
+    curr = curr->child[0];
+  }
+
+  return curr;
+}
+
+td_node_t *tdrbtree_max(const tdrbtree *t) {
+  td_node_t *curr = t->root;
+
+  if (curr == NULL) {
+    return NULL;
+  }
+
+  while (curr->child[1] != NULL) {
+    curr = curr->child[1];
+  }
+
+  return curr;
+}
+
+// key를 가진 노드 하나를 삭제한다. 노드 포인터 대신 key로 지정한다.
+// 자식이 둘인 노드는 선임자의 key를 복사해 오므로 다른 노드 포인터의
+// key가 바뀔 수 있다.
+int tdrbtree_erase(tdrbtree *t, const key_t key) {
+  if (t->root == NULL) {
+    return -1;
+  }
+
+  td_node_t head = {RBTREE_BLACK, 0, {NULL, NULL}};
+  td_node_t *grand = NULL;
+  td_node_t *parent = NULL;
+  td_node_t *curr = &head;
+  td_node_t *found = NULL;
+  int dir = 1;
+
+  head.child[1] = t->root;
+
+  // 내려가면서 현재 노드가 항상 빨간색이 되도록 만든다
+  while (curr->child[dir] != NULL) {
+    const int last = dir;
+
+    grand = parent;
+    parent = curr;
+    curr = curr->child[dir];
+    dir = curr->key < key;
+
+    if (curr->key == key) {
+      found = curr;
+    }
+
+    if (is_red(curr) || is_red(curr->child[dir])) {
+      continue;
+    }
+
+    // 반대쪽 자식이 빨간색이면 회전해서 빨간색을 끌어내린다
+    if (is_red(curr->child[!dir])) {
+      parent = parent->child[last] = rotate_single(curr, dir);
+      continue;
+    }
+
+    td_node_t *sibling = parent->child[!last];
+
+    if (sibling == NULL) {
+      continue;
+    }
+
+    if (!is_red(sibling->child[0]) && !is_red(sibling->child[1])) {
+      // 형제의 자식이 모두 검은색이면 색만 뒤집는다
+      parent->color = RBTREE_BLACK;
+      sibling->color = RBTREE_RED;
+      curr->color = RBTREE_RED;
+    } else {
+      const int dir2 = grand->child[1] == parent;
+
+      if (is_red(sibling->child[last])) {
+        grand->child[dir2] = rotate_double(parent, last);
+      } else {
+        grand->child[dir2] = rotate_single(parent, last);
+      }
+
+      // 색을 다시 맞춘다
+      curr->color = grand->child[dir2]->color = RBTREE_RED;
+      grand->child[dir2]->child[0]->color = RBTREE_BLACK;
+      grand->child[dir2]->child[1]->color = RBTREE_BLACK;
+    }
+  }
+
+  // curr는 found의 선임자(또는 found 자신)이고 자식이 하나 이하이다
+  if (found != NULL) {
+    found->key = curr->key;
+    parent->child[parent->child[1] == curr] =
+        curr->child[curr->child[0] == NULL];
+    free(curr);
+    t->size--;
+  }
+
+  t->root = head.child[1];
+  if (t->root != NULL) {
+    t->root->color = RBTREE_BLACK;
+  }
+
+  return found != NULL ? 0 : -1;
+}
+
+static size_t td_inorder(const td_node_t *p, size_t idx, key_t *arr,
+                         const size_t n) {
+  if (p == NULL || idx >= n) {
+    return idx;
+  }
+
+  idx = td_inorder(p->child[0], idx, arr, n);
+  if (idx < n) {
+    arr[idx++] = p->key;
+  }
+  return td_inorder(p->child[1], idx, arr, n);
+}
+
+int tdrbtree_to_array(const tdrbtree *t, key_t *arr, const size_t n) {
+  td_inorder(t->root, 0, arr, n);
+  return 0;
+}
@@ -0,0 +1,29 @@
+#ifndef _TDRBTREE_H_
+#define _TDRBTREE_H_
+
+#include "rbtree.h"
+
+// parent 포인터 없이 내려가면서 한 번에 균형을 맞추는 (top-down) RB tree
+typedef struct td_node_t {
+  color_t color;
+  key_t key;
+  struct td_node_t *child[2];  // 0: left, 1: right
+} td_node_t;
+
+typedef struct {
+  td_node_t *root;
+  size_t size;
+} tdrbtree;
+
+tdrbtree *new_tdrbtree(void);
+void delete_tdrbtree(tdrbtree *);
+
+td_node_t *tdrbtree_insert(tdrbtree *, const key_t);
+td_node_t *tdrbtree_find(const tdrbtree *, const key_t);
+td_node_t *tdrbtree_min(const tdrbtree *);
+td_node_t *tdrbtree_max(const tdrbtree *);
+int tdrbtree_erase(tdrbtree *, const key_t);
+
+int tdrbtree_to_array(const tdrbtree *, key_t *, const size_t);
+
+#endif  // _TDRBTREE_H_
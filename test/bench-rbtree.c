@@ -0,0 +1,433 @@
+#include <malloc.h>
+#include <rbtree.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tdrbtree.h>
+#include <time.h>
+
+// Throughput benchmarks for rbtree operations.
+// Usage: ./bench-rbtree [name...]  (runs every benchmark if no name is given)
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double min_d(const double a, const double b) { return a < b ? a : b; }
+
+static key_t *random_keys(const size_t n) {
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand();
+  }
+  return arr;
+}
+
+static rbtree *tree_with(const key_t *keys, const size_t n) {
+  rbtree *t = new_rbtree();
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, keys[i]);
+  }
+  return t;
+}
+
+// per-key rbtree_insert vs rbtree_insert_batch into a tree of base keys
+static void bench_batch(void) {
+  const size_t bases[] = {0, 100000, 1000000};
+  const size_t batches[] = {1000, 10000, 100000, 1000000};
+
+  printf("# batch: base batch per_key_Mkeys/s batch_Mkeys/s\n");
+  for (size_t b = 0; b < sizeof(bases) / sizeof(bases[0]); b++) {
+    key_t *base = random_keys(bases[b]);
+    for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++) {
+      const size_t n = batches[i];
+      key_t *keys = random_keys(n);
+
+      double per_key = 1e9, batch = 1e9;
+
+      // alternate the two variants three times and keep the best run
+      for (int r = 0; r < 3; r++) {
+        rbtree *t = tree_with(base, bases[b]);
+        double start = now_sec();
+        for (size_t j = 0; j < n; j++) {
+          rbtree_insert(t, keys[j]);
+        }
+        per_key = min_d(per_key, now_sec() - start);
+        delete_rbtree(t);
+
+        t = tree_with(base, bases[b]);
+        start = now_sec();
+        rbtree_insert_batch(t, keys, n);
+        batch = min_d(batch, now_sec() - start);
+        delete_rbtree(t);
+      }
+
+      printf("batch %zu %zu %.2f %.2f\n", bases[b], n, n / per_key / 1e6,
+             n / batch / 1e6);
+      free(keys);
+    }
+    free(base);
+  }
+}
+
+static size_t heap_in_use(void) { return mallinfo2().uordblks; }
+
+// bottom-up rbtree vs parent-free top-down tdrbtree: bytes per node and
+// insert/find/erase throughput
+static void bench_topdown(void) {
+  const size_t sizes[] = {10000, 100000, 1000000};
+
+  printf("# topdown: variant n sizeof heap_bytes/node insert find erase "
+         "(Mops/s)\n");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const size_t n = sizes[s];
+    key_t *keys = random_keys(n);
+
+    size_t heap = heap_in_use();
+    double start = now_sec();
+    rbtree *t = new_rbtree();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_insert(t, keys[i]);
+    }
+    const double ins = now_sec() - start;
+    const double bytes = (double)(heap_in_use() - heap) / n;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(t, keys[i]);
+    }
+    const double fnd = now_sec() - start;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_erase(t, rbtree_find(t, keys[i]));
+    }
+    const double ers = now_sec() - start;
+    delete_rbtree(t);
+    printf("topdown bottom-up %zu %zu %.1f %.2f %.2f %.2f\n", n,
+           sizeof(node_t), bytes, n / ins / 1e6, n / fnd / 1e6,
+           n / ers / 1e6);
+
+    heap = heap_in_use();
+    start = now_sec();
+    tdrbtree *td = new_tdrbtree();
+    for (size_t i = 0; i < n; i++) {
+      tdrbtree_insert(td, keys[i]);
+    }
+    const double td_ins = now_sec() - start;
+    const double td_bytes = (double)(heap_in_use() - heap) / n;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      tdrbtree_find(td, keys[i]);
+    }
+    const double td_fnd = now_sec() - start;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      tdrbtree_erase(td, keys[i]);
+    }
+    const double td_ers = now_sec() - start;
+    delete_tdrbtree(td);
+    printf("topdown top-down %zu %zu %.1f %.2f %.2f %.2f\n", n,
+           sizeof(td_node_t), td_bytes, n / td_ins / 1e6, n / td_fnd / 1e6,
+           n / td_ers / 1e6);
+
+    free(keys);
+  }
+}
+
+// rbtree_to_array + per-key insert vs rbtree_clone, and lookups on the copy
+static void bench_clone(void) {
+  const size_t sizes[] = {10000, 100000, 1000000};
+
+  printf("# clone: n copy_ms clone_ms find_copy_Mops/s find_clone_Mops/s\n");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const size_t n = sizes[s];
+    key_t *keys = random_keys(n);
+    key_t *arr = calloc(n, sizeof(key_t));
+    rbtree *t = tree_with(keys, n);
+
+    double start = now_sec();
+    rbtree_to_array(t, arr, n);
+    rbtree *copy = tree_with(arr, n);
+    const double copy_time = now_sec() - start;
+
+    start = now_sec();
+    rbtree *c = rbtree_clone(t);
+    const double clone_time = now_sec() - start;
+
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(copy, keys[i]);
+    }
+    const double find_copy = now_sec() - start;
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(c, keys[i]);
+    }
+    const double find_clone = now_sec() - start;
+
+    printf("clone %zu %.2f %.2f %.2f %.2f\n", n, copy_time * 1e3,
+           clone_time * 1e3, n / find_copy / 1e6, n / find_clone / 1e6);
+
+    delete_rbtree(c);
+    delete_rbtree(copy);
+    delete_rbtree(t);
+    free(arr);
+    free(keys);
+  }
+}
+
+// lookups on a tree fragmented by churn, before and after rbtree_relayout
+static void bench_relayout(void) {
+  const size_t sizes[] = {100000, 1000000, 4000000};
+
+  printf("# relayout: n find_before_ns relayout_ms find_after_ns\n");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const size_t n = sizes[s];
+    key_t *keys = random_keys(n);
+    rbtree *t = tree_with(keys, n);
+
+    // replace half of the keys a few times to scatter nodes over the heap
+    for (int round = 0; round < 4; round++) {
+      for (size_t i = round % 2; i < n; i += 2) {
+        rbtree_erase(t, rbtree_find(t, keys[i]));
+        keys[i] = rand();
+        rbtree_insert(t, keys[i]);
+      }
+    }
+
+    key_t *probe = calloc(n, sizeof(key_t));
+    for (size_t i = 0; i < n; i++) {
+      probe[i] = keys[rand() % n];
+    }
+
+    double start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(t, probe[i]);
+    }
+    const double before = now_sec() - start;
+
+    start = now_sec();
+    rbtree_relayout(t);
+    const double relayout = now_sec() - start;
+
+    start = now_sec();
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(t, probe[i]);
+    }
+    const double after = now_sec() - start;
+
+    printf("relayout %zu %.1f %.2f %.1f\n", n, before * 1e9 / n,
+           relayout * 1e3, after * 1e9 / n);
+
+    delete_rbtree(t);
+    free(probe);
+    free(keys);
+  }
+}
+
+// many tiny trees: new_rbtree vs new_small_rbtree for create + insert +
+// find + delete, and heap bytes per live tree
+static void bench_small(void) {
+  const size_t n_trees = 1000000;
+  const size_t per_tree[] = {1, 4, RBTREE_SMALL_MAX, 2 * RBTREE_SMALL_MAX};
+  rbtree **trees = calloc(n_trees, sizeof(rbtree *));
+  // pooled small headers are never returned to malloc, so their bytes are
+  // measured from the heap level before the first small tree was created
+  const size_t heap_start = heap_in_use();
+
+  printf("# small: keys variant bytes_per_tree build_ns find_ns delete_ns\n");
+  for (size_t k = 0; k < sizeof(per_tree) / sizeof(per_tree[0]); k++) {
+    const size_t m = per_tree[k];
+    for (int small = 0; small < 2; small++) {
+      const size_t heap_before = small ? heap_start : heap_in_use();
+
+      double start = now_sec();
+      for (size_t i = 0; i < n_trees; i++) {
+        trees[i] = small ? new_small_rbtree() : new_rbtree();
+        for (size_t j = 0; j < m; j++) {
+          rbtree_insert(trees[i], (i + j * 7919) % 1000);
+        }
+      }
+      const double build = now_sec() - start;
+      const size_t bytes = heap_in_use() - heap_before;
+
+      start = now_sec();
+      size_t hits = 0;
+      for (size_t i = 0; i < n_trees; i++) {
+        hits += rbtree_find(trees[i], (i + 7919) % 1000) != NULL;
+      }
+      const double find = now_sec() - start;
+
+      start = now_sec();
+      for (size_t i = 0; i < n_trees; i++) {
+        delete_rbtree(trees[i]);
+      }
+      const double del = now_sec() - start;
+
+      printf("small %zu %s %.1f %.1f %.1f %.1f%s\n", m,
+             small ? "small" : "default", (double)bytes / n_trees,
+             build * 1e9 / n_trees, find * 1e9 / n_trees,
+             del * 1e9 / n_trees, hits > 0 ? "" : " (no hits)");
+    }
+  }
+  free(trees);
+}
+
+static int double_compare(const void *p1, const void *p2) {
+  const double a = *(const double *)p1;
+  const double b = *(const double *)p2;
+  return (a > b) - (a < b);
+}
+
+// bursty ingest into a large tree: per-insert latency quantiles with and
+// without the insert buffer, with lookups between the bursts
+static void bench_buffer(void) {
+  const size_t base_n = 1000000;
+  const size_t bursts = 200, burst = 5000, gap_finds = 20000;
+  const size_t caps[] = {0, 64, 256, 1024};
+  key_t *base = random_keys(base_n);
+  double *lat = calloc(bursts * burst, sizeof(double));
+
+  printf("# buffer: cap p50_ns p99_ns p999_ns max_ns insert_Mkeys/s "
+         "find_ns\n");
+  for (size_t c = 0; c < sizeof(caps) / sizeof(caps[0]); c++) {
+    srand(23);
+    rbtree *t = tree_with(base, base_n);
+    rbtree_set_insert_buffer(t, caps[c]);
+
+    double insert_total = 0, find_total = 0;
+    for (size_t b = 0; b < bursts; b++) {
+      for (size_t i = 0; i < burst; i++) {
+        const key_t key = rand();
+        const double start = now_sec();
+        rbtree_insert(t, key);
+        lat[b * burst + i] = now_sec() - start;
+        insert_total += lat[b * burst + i];
+      }
+
+      const double start = now_sec();
+      for (size_t i = 0; i < gap_finds; i++) {
+        rbtree_find(t, base[rand() % base_n]);
+      }
+      find_total += now_sec() - start;
+    }
+
+    const size_t n = bursts * burst;
+    qsort(lat, n, sizeof(double), double_compare);
+    printf("buffer %zu %.0f %.0f %.0f %.0f %.2f %.1f\n", caps[c],
+           lat[n / 2] * 1e9, lat[n * 99 / 100] * 1e9,
+           lat[n * 999 / 1000] * 1e9, lat[n - 1] * 1e9,
+           n / insert_total / 1e6, find_total * 1e9 / (bursts * gap_finds));
+    delete_rbtree(t);
+  }
+
+  free(lat);
+  free(base);
+}
+
+// AnonHugePages of this process in KiB, 0 if it cannot be read
+static size_t anon_huge_kb(void) {
+  FILE *fp = fopen("/proc/self/smaps_rollup", "r");
+  char line[256];
+  size_t kb = 0;
+
+  if (fp == NULL) {
+    return 0;
+  }
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(fp);
+  return kb;
+}
+
+// random finds on trees well beyond the TLB reach (1536 x 4 KiB = 6 MiB on
+// a typical STLB), with nodes from malloc vs from 2 MiB huge-page blocks
+static void bench_hugepage(void) {
+  const size_t sizes[] = {1000000, 4000000, 8000000};
+  const size_t n_finds = 2000000;
+
+  printf("# hugepage: n variant find_ns reserved_MiB fragmentation "
+         "anon_huge_MiB erase_ns delete_ms\n");
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    const size_t n = sizes[s];
+    key_t *keys = random_keys(n);
+    key_t *probe = calloc(n_finds, sizeof(key_t));
+    for (size_t i = 0; i < n_finds; i++) {
+      probe[i] = keys[rand() % n];
+    }
+
+    for (int huge = 0; huge < 2; huge++) {
+      const size_t huge_before = anon_huge_kb();
+      rbtree *t = new_rbtree();
+      rbtree_set_huge_pages(t, huge);
+      for (size_t i = 0; i < n; i++) {
+        rbtree_insert(t, keys[i]);
+      }
+
+      double best = 1e9;
+      for (int r = 0; r < 3; r++) {
+        const double start = now_sec();
+        for (size_t i = 0; i < n_finds; i++) {
+          rbtree_find(t, probe[i]);
+        }
+        best = min_d(best, now_sec() - start);
+      }
+
+      const rbtree_memory m = rbtree_memory_usage(t);
+      const size_t huge_kb = anon_huge_kb();
+
+      // erase half of the keys, then delete the tree with the other half
+      double start = now_sec();
+      for (size_t i = 0; i < n / 2; i++) {
+        rbtree_erase(t, rbtree_find(t, keys[i]));
+      }
+      const double erase = now_sec() - start;
+
+      start = now_sec();
+      delete_rbtree(t);
+      const double del = now_sec() - start;
+
+      printf("hugepage %zu %s %.1f %.1f %.3f %.1f %.1f %.1f\n", n,
+             huge ? "huge" : "malloc", best * 1e9 / n_finds,
+             m.reserved_bytes / 1048576.0, m.fragmentation,
+             (huge_kb > huge_before ? huge_kb - huge_before : 0) / 1024.0,
+             erase * 1e9 / (n / 2), del * 1e3);
+    }
+
+    free(probe);
+    free(keys);
+  }
+}
+
+static const struct {
+  const char *name;
+  void (*run)(void);
+} benches[] = {
+    {"batch", bench_batch},
+    {"topdown", bench_topdown},
+    {"clone", bench_clone},
+    {"relayout", bench_relayout},
+    {"small", bench_small},
+    {"buffer", bench_buffer},
+    {"hugepage", bench_hugepage},
+};
+
+int main(int argc, char *argv[]) {
+  const size_t n = sizeof(benches) / sizeof(benches[0]);
+
+  srand(17);
+  for (size_t i = 0; i < n; i++) {
+    int selected = argc < 2;
+    for (int j = 1; j < argc; j++) {
+      selected |= strcmp(argv[j], benches[i].name) == 0;
+    }
+    if (selected) {
+      benches[i].run();
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,266 @@
+#include <linux/perf_event.h>
+#include <rbtree.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Per-operation hardware counters (perf_event_open) for each rbtree
+// operation across tree sizes from in-cache to well beyond the LLC.
+// Prints one CSV row per (op, n); counters that cannot be opened (no PMU,
+// perf_event_paranoid, containers) are reported as -1.
+// All counters are opened as one event group so that they are enabled,
+// disabled and scheduled together over the same window. If the kernel had
+// to multiplex the group (time running < time enabled) the sample is
+// reported as -1 instead of being extrapolated.
+// Usage: ./perf-rbtree [max tree size]
+
+enum { CYCLES, INSTRUCTIONS, L1D_MISSES, LLC_MISSES, BRANCH_MISSES, NCOUNTERS };
+
+static const char *counter_names[NCOUNTERS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses",
+};
+
+static int counter_fds[NCOUNTERS];
+static int group_leader = -1;
+static int group_index[NCOUNTERS];  // position in the group read, -1 if absent
+static int group_size;
+
+static void counter_attr(const int c, struct perf_event_attr *attr) {
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+
+  switch (c) {
+    case CYCLES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case INSTRUCTIONS:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case L1D_MISSES:
+      attr->type = PERF_TYPE_HW_CACHE;
+      attr->config = PERF_COUNT_HW_CACHE_L1D |
+                     (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+      break;
+    case LLC_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case BRANCH_MISSES:
+      attr->type = PERF_TYPE_HARDWARE;
+      attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+      break;
+  }
+}
+
+// the first counter that opens becomes the group leader; only the leader
+// starts disabled, members follow it
+static void counters_open(void) {
+  for (int c = 0; c < NCOUNTERS; c++) {
+    struct perf_event_attr attr;
+    counter_attr(c, &attr);
+    attr.disabled = group_leader < 0;
+    counter_fds[c] =
+        syscall(SYS_perf_event_open, &attr, 0, -1, group_leader, 0);
+    group_index[c] = -1;
+    if (counter_fds[c] >= 0) {
+      if (group_leader < 0) {
+        group_leader = counter_fds[c];
+      }
+      group_index[c] = group_size++;
+    }
+  }
+}
+
+static void counters_close(void) {
+  for (int c = 0; c < NCOUNTERS; c++) {
+    if (counter_fds[c] >= 0) {
+      close(counter_fds[c]);
+    }
+  }
+}
+
+static void counters_start(void) {
+  if (group_leader >= 0) {
+    ioctl(group_leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(group_leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  }
+}
+
+static void counters_stop(int64_t *values) {
+  for (int c = 0; c < NCOUNTERS; c++) {
+    values[c] = -1;
+  }
+  if (group_leader < 0) {
+    return;
+  }
+
+  ioctl(group_leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  // PERF_FORMAT_GROUP layout: nr, time_enabled, time_running, value[nr]
+  uint64_t buf[3 + NCOUNTERS];
+  const ssize_t want = (3 + group_size) * sizeof(uint64_t);
+  if (read(group_leader, buf, sizeof(buf)) < want || buf[0] != group_size) {
+    return;
+  }
+  // the group was not on the PMU for the whole window
+  if (buf[2] == 0 || buf[2] != buf[1]) {
+    return;
+  }
+
+  for (int c = 0; c < NCOUNTERS; c++) {
+    if (group_index[c] >= 0) {
+      values[c] = buf[3 + group_index[c]];
+    }
+  }
+}
+
+static double now_sec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct {
+  int64_t values[NCOUNTERS];
+  double start;
+  double seconds;
+} sample;
+
+static void sample_begin(sample *s) {
+  counters_start();
+  s->start = now_sec();
+}
+
+static void sample_end(sample *s) {
+  s->seconds = now_sec() - s->start;
+  counters_stop(s->values);
+}
+
+static void report(const char *op, const size_t n, const size_t ops,
+                   const sample *s) {
+  printf("%s,%zu,%zu,%.2f", op, n, ops, s->seconds * 1e9 / ops);
+  for (int c = 0; c < NCOUNTERS; c++) {
+    if (s->values[c] < 0) {
+      printf(",-1");
+    } else {
+      printf(",%.2f", (double)s->values[c] / ops);
+    }
+  }
+  printf("\n");
+}
+
+static void bench_size(const size_t n) {
+  key_t *keys = calloc(n, sizeof(key_t));
+  key_t *arr = calloc(n, sizeof(key_t));
+  // distinct keys in random order so that every find hits a unique node
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    const size_t j = rand() % (i + 1);
+    const key_t tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+
+  // enough repetitions that small trees still run for a measurable time
+  const size_t reps = n < 1000000 ? 1000000 / n : 1;
+  sample s;
+
+  rbtree *t = new_rbtree();
+  sample_begin(&s);
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, keys[i]);
+  }
+  sample_end(&s);
+  report("insert", n, n, &s);
+
+  sample_begin(&s);
+  for (size_t r = 0; r < reps; r++) {
+    for (size_t i = 0; i < n; i++) {
+      rbtree_find(t, keys[i]);
+    }
+  }
+  sample_end(&s);
+  report("find", n, n * reps, &s);
+
+  sample_begin(&s);
+  for (size_t r = 0; r < reps * n; r++) {
+    rbtree_min(t);
+  }
+  sample_end(&s);
+  report("min", n, n * reps, &s);
+
+  sample_begin(&s);
+  for (size_t r = 0; r < reps * n; r++) {
+    rbtree_max(t);
+  }
+  sample_end(&s);
+  report("max", n, n * reps, &s);
+
+  // per key so that numbers are comparable across sizes
+  sample_begin(&s);
+  for (size_t r = 0; r < reps; r++) {
+    rbtree_to_array(t, arr, n);
+  }
+  sample_end(&s);
+  report("to_array", n, n * reps, &s);
+
+  // erase removes nodes by pointer; look them up outside the measured region
+  node_t **nodes = calloc(n, sizeof(node_t *));
+  for (size_t i = 0; i < n; i++) {
+    nodes[i] = rbtree_find(t, keys[i]);
+  }
+  sample_begin(&s);
+  for (size_t i = 0; i < n; i++) {
+    rbtree_erase(t, nodes[i]);
+  }
+  sample_end(&s);
+  report("erase", n, n, &s);
+
+  delete_rbtree(t);
+  free(nodes);
+  free(arr);
+  free(keys);
+}
+
+int main(int argc, char *argv[]) {
+  const size_t max_n = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 22;
+
+  counters_open();
+  int available = 0;
+  for (int c = 0; c < NCOUNTERS; c++) {
+    available += counter_fds[c] >= 0;
+  }
+  if (available == 0) {
+    fprintf(stderr, "perf-rbtree: no hardware counters available\n");
+  }
+
+  printf("op,n,ops,ns_per_op");
+  for (int c = 0; c < NCOUNTERS; c++) {
+    printf(",%s_per_op", counter_names[c]);
+  }
+  printf("\n");
+
+  srand(17);
+  // 1K nodes (32 KiB) roughly fit in L1, 4M nodes (128 MiB) are well
+  // beyond a typical LLC
+  for (size_t n = 1 << 10; n <= max_n; n <<= 2) {
+    bench_size(n);
+  }
+
+  counters_close();
+  return 0;
+}
@@ -1,8 +1,11 @@
 #include <assert.h>
+#include <pthread.h>
 #include <rbtree.h>
+#include <tdrbtree.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 // new_rbtree should return rbtree struct with null root node
 void test_init(void) {
@@ -314,6 +317,7 @@ void test_find_erase(rbtree *t, const key_t *arr, const size_t n) {
   for (int i = 0; i < n; i++) {
     node_t *p = rbtree_insert(t, arr[i]);
     assert(p != NULL);
+    assert(p->key == arr[i]);  // the inserted node, not the root
   }
 
   for (int i = 0; i < n; i++) {
@@ -367,6 +371,823 @@ void test_find_erase_rand(const size_t n, const unsigned int seed) {
   delete_rbtree(t);
 }
 
+// rbtree_insert returns the inserted node in every mode, so erasing it
+// removes exactly that key
+void test_insert_returns_node() {
+  for (int mode = 0; mode < 4; mode++) {
+    rbtree *t = mode == 1 ? new_small_rbtree() : new_rbtree();
+    if (mode == 2) {
+      rbtree_set_insert_buffer(t, 16);
+    } else if (mode == 3) {
+      rbtree_set_lazy_erase(t, 0.5);
+    }
+    for (key_t k = 0; k < 5; k++) {
+      rbtree_insert(t, 10 * k);
+    }
+    node_t *p = rbtree_insert(t, 25);
+    assert(p->key == 25);
+    assert(rbtree_erase(t, p) == 0);
+    assert(rbtree_find(t, 25) == NULL);
+    for (key_t k = 0; k < 5; k++) {
+      assert(rbtree_find(t, 10 * k) != NULL);
+    }
+    delete_rbtree(t);
+  }
+}
+
+// batch insert should keep constraints and hold the union of both key sets
+void test_insert_batch(const size_t n_tree, const size_t n_batch,
+                       const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  const size_t n = n_tree + n_batch;
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n / 2 + 1);
+  }
+
+  insert_arr(t, arr, n_tree);
+  assert(rbtree_insert_batch(t, arr + n_tree, n_batch) == 0);
+  assert(t->size == n);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  key_t *res = calloc(n, sizeof(key_t));
+  rbtree_to_array(t, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == res[i]);
+  }
+
+  free(res);
+  free(arr);
+  delete_rbtree(t);
+}
+
+void test_insert_batch_suite() {
+  test_insert_batch(0, 1, 31);
+  test_insert_batch(0, 1000, 31);
+  test_insert_batch(100, 1000, 37);
+  test_insert_batch(1000, 50, 41);
+  test_insert_batch(10000, 777, 43);
+}
+
+// lazy erase should hide tombstones from find/min/max/to_array and
+// compaction should drop them while keeping the rb constraints
+void test_lazy_erase() {
+  const key_t arr[] = {10, 5, 8, 34, 67, 23, 156, 24, 2, 12, 24, 36, 990, 25};
+  const size_t n = sizeof(arr) / sizeof(arr[0]);
+  rbtree *t = new_rbtree();
+  rbtree_set_lazy_erase(t, 0.5);
+  test_find_erase(t, arr, n);
+  delete_rbtree(t);
+
+  t = new_rbtree();
+  rbtree_set_lazy_erase(t, 0.5);
+  key_t sorted[sizeof(arr) / sizeof(arr[0])];
+  memcpy(sorted, arr, sizeof(arr));
+  insert_arr(t, sorted, n);
+  qsort((void *)sorted, n, sizeof(key_t), comp);
+
+  // tombstone the two smallest and the largest keys
+  assert(rbtree_erase(t, rbtree_min(t)) == 0);
+  node_t *p = rbtree_min(t);
+  assert(rbtree_erase(t, p) == 0);
+  assert(rbtree_erase(t, p) == -1);
+  assert(rbtree_erase(t, rbtree_max(t)) == 0);
+  assert(t->ext->dead == 3 && t->size == n);
+  assert(rbtree_min(t)->key == sorted[2]);
+  assert(rbtree_max(t)->key == sorted[n - 2]);
+  assert(rbtree_find(t, sorted[0]) == NULL);
+
+  key_t res[sizeof(arr) / sizeof(arr[0])];
+  rbtree_to_array(t, res, n - 3);
+  for (size_t i = 0; i < n - 3; i++) {
+    assert(res[i] == sorted[i + 2]);
+  }
+
+  assert(rbtree_compact(t) == 0);
+  assert(t->ext->dead == 0 && t->size == n - 3);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  // erasing more than half of the tree triggers an inline compaction
+  for (size_t i = 0; i < n / 2; i++) {
+    rbtree_erase(t, rbtree_find(t, sorted[i + 2]));
+  }
+  assert(t->ext->dead < n / 2);
+  test_color_constraint(t);
+  delete_rbtree(t);
+}
+
+static bool same_shape(const node_t *p, const node_t *p_nil, const node_t *q,
+                       const node_t *q_nil) {
+  if (p == p_nil || q == q_nil) {
+    return p == p_nil && q == q_nil;
+  }
+  return p != q && p->key == q->key && p->color == q->color &&
+         (q->left == q_nil || q->left->parent == q) &&
+         (q->right == q_nil || q->right->parent == q) &&
+         same_shape(p->left, p_nil, q->left, q_nil) &&
+         same_shape(p->right, p_nil, q->right, q_nil);
+}
+
+// clone should copy shape and colors, and both trees should stay independent
+void test_clone(const size_t n, const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n + 1);
+  }
+  insert_arr(t, arr, n);
+
+  rbtree *c = rbtree_clone(t);
+  assert(c != NULL && c->size == t->size);
+  assert(same_shape(t->root, t->nil, c->root, c->nil));
+  assert(c->root == c->nil || c->root->parent == c->nil);
+  test_color_constraint(c);
+  test_search_constraint(c);
+
+  // erase from the clone and insert again: the original must not change
+  for (size_t i = 0; i < n; i += 2) {
+    assert(rbtree_erase(c, rbtree_find(c, arr[i])) == 0);
+  }
+  for (size_t i = 0; i < n; i += 2) {
+    rbtree_insert(c, arr[i] + 1);
+  }
+  for (size_t i = 0; i < n; i++) {
+    assert(rbtree_find(t, arr[i]) != NULL);
+  }
+  test_color_constraint(c);
+  test_search_constraint(c);
+
+  rbtree *e = new_rbtree();
+  rbtree *ec = rbtree_clone(e);
+  assert(ec->root == ec->nil && ec->size == 0);
+
+  delete_rbtree(ec);
+  delete_rbtree(e);
+  delete_rbtree(c);
+  delete_rbtree(t);
+  free(arr);
+}
+
+// relayout should move every node into one block in BFS order without
+// changing the shape, colors or contents
+void test_relayout(const size_t n, const unsigned int seed) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n + 1);
+  }
+  insert_arr(t, arr, n);
+  for (size_t i = 0; i < n; i += 3) {
+    rbtree_erase(t, rbtree_find(t, arr[i]));
+  }
+
+  rbtree *c = rbtree_clone(t);
+  assert(rbtree_relayout(t) == 0);
+  assert(same_shape(c->root, c->nil, t->root, t->nil));
+  assert(t->ext->blocks != NULL && t->ext->blocks->next == NULL);
+  assert(t->root == &t->ext->blocks->nodes[0]);
+  assert(t->root->parent == t->nil);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  // keep using the relocated tree: erased block nodes are reused by inserts
+  for (size_t i = 1; i < n; i += 3) {
+    assert(rbtree_erase(t, rbtree_find(t, arr[i])) == 0);
+    rbtree_insert(t, arr[i]);
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  // automatic relayout after n/2 updates
+  rbtree_set_auto_relayout(t, 0.5);
+  for (size_t i = 0; i < n; i++) {
+    rbtree_insert(t, arr[i]);
+  }
+  assert(t->ext->churn <= t->size / 2);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  delete_rbtree(c);
+  delete_rbtree(t);
+  free(arr);
+}
+
+// trace should record every public operation in call order
+void test_trace() {
+  const char *path = "test-rbtree.trace";
+  rbtree *t = new_rbtree();
+  assert(rbtree_trace_start(t, path) == 0);
+
+  const key_t batch[] = {7, 3};
+  key_t res[4];
+  rbtree_insert(t, 5);
+  rbtree_find(t, 5);
+  rbtree_insert_batch(t, batch, 2);
+  rbtree_min(t);
+  rbtree_max(t);
+  rbtree_erase(t, rbtree_find(t, 3));
+  rbtree_to_array(t, res, 4);
+  assert(rbtree_trace_stop(t) == 0);
+  assert(rbtree_trace_stop(t) == 0);
+  rbtree_insert(t, 9);  // not recorded
+  delete_rbtree(t);
+
+  const rbtree_trace_rec expected[] = {
+      {RBTREE_OP_INSERT, 5},   {RBTREE_OP_FIND, 5},
+      {RBTREE_OP_BATCH, 2},    {RBTREE_OP_BATCH_KEY, 7},
+      {RBTREE_OP_BATCH_KEY, 3}, {RBTREE_OP_MIN, 0},
+      {RBTREE_OP_MAX, 0},      {RBTREE_OP_FIND, 3},
+      {RBTREE_OP_ERASE, 3},    {RBTREE_OP_TO_ARRAY, 4},
+  };
+  const size_t n = sizeof(expected) / sizeof(expected[0]);
+
+  FILE *fp = fopen(path, "rb");
+  assert(fp != NULL);
+  char magic[8];
+  assert(fread(magic, 1, 8, fp) == 8);
+  assert(memcmp(magic, RBTREE_TRACE_MAGIC, 8) == 0);
+  rbtree_trace_rec rec;
+  for (size_t i = 0; i < n; i++) {
+    assert(fread(&rec, sizeof(rec), 1, fp) == 1);
+    assert(rec.op == expected[i].op && rec.key == expected[i].key);
+  }
+  assert(fread(&rec, sizeof(rec), 1, fp) == 0);
+  fclose(fp);
+  remove(path);
+
+  // a write failure (here: a full device) is reported when the trace stops
+  FILE *full = fopen("/dev/full", "wb");
+  if (full != NULL) {
+    fclose(full);
+    t = new_rbtree();
+    assert(rbtree_trace_start(t, "/dev/full") == 0);
+    for (key_t i = 0; i < 1000; i++) {
+      rbtree_insert(t, i);
+    }
+    assert(rbtree_trace_stop(t) == -1);
+    delete_rbtree(t);
+  }
+}
+
+// top-down variant: same search tree and color constraints without parents
+static int td_black_height(const td_node_t *p) {
+  if (p == NULL) {
+    return 1;
+  }
+  if (p->color == RBTREE_RED) {
+    assert(p->child[0] == NULL || p->child[0]->color == RBTREE_BLACK);
+    assert(p->child[1] == NULL || p->child[1]->color == RBTREE_BLACK);
+  }
+  assert(p->child[0] == NULL || p->child[0]->key <= p->key);
+  assert(p->child[1] == NULL || p->child[1]->key >= p->key);
+  const int l = td_black_height(p->child[0]);
+  const int r = td_black_height(p->child[1]);
+  assert(l == r);
+  return l + (p->color == RBTREE_BLACK);
+}
+
+static void test_td_contents(const tdrbtree *t, key_t *arr, const size_t n) {
+  assert(t->size == n);
+  assert(t->root == NULL || t->root->color == RBTREE_BLACK);
+  td_black_height(t->root);
+  if (n == 0) {
+    assert(t->root == NULL);
+    return;
+  }
+
+  qsort((void *)arr, n, sizeof(key_t), comp);
+  key_t *res = calloc(n, sizeof(key_t));
+  tdrbtree_to_array(t, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(arr[i] == res[i]);
+  }
+  assert(tdrbtree_min(t)->key == arr[0]);
+  assert(tdrbtree_max(t)->key == arr[n - 1]);
+  free(res);
+}
+
+void test_tdrbtree(const size_t n, const unsigned int seed) {
+  srand(seed);
+  tdrbtree *t = new_tdrbtree();
+  assert(t != NULL && t->root == NULL);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n / 2 + 1);
+    td_node_t *p = tdrbtree_insert(t, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+  }
+  test_td_contents(t, arr, n);
+
+  // erase every other key, then the rest
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (i % 2 == 0) {
+      assert(tdrbtree_erase(t, arr[i]) == 0);
+    } else {
+      arr[m++] = arr[i];
+    }
+  }
+  test_td_contents(t, arr, m);
+  assert(tdrbtree_erase(t, -1) == -1);
+
+  for (size_t i = 0; i < m; i++) {
+    assert(tdrbtree_find(t, arr[i]) != NULL);
+    assert(tdrbtree_erase(t, arr[i]) == 0);
+  }
+  test_td_contents(t, arr, 0);
+  assert(tdrbtree_find(t, 0) == NULL);
+
+  free(arr);
+  delete_tdrbtree(t);
+}
+
+// model check of the insert buffer: the tree with a pending buffer must
+// answer like a sorted array of every key inserted so far
+static void check_buffered(const rbtree *t, const key_t *sorted, key_t *res,
+                           const size_t m) {
+  assert(t->size == m);
+  rbtree_to_array(t, res, m);
+  for (size_t i = 0; i < m; i++) {
+    assert(res[i] == sorted[i]);
+  }
+  // a short output array still gets the smallest keys
+  if (m > 3) {
+    rbtree_to_array(t, res, 3);
+    assert(res[0] == sorted[0] && res[1] == sorted[1] && res[2] == sorted[2]);
+  }
+  assert(m == 0 || rbtree_min(t)->key == sorted[0]);
+  assert(m == 0 || rbtree_max(t)->key == sorted[m - 1]);
+}
+
+void test_insert_buffer(const size_t n, const size_t cap,
+                        const unsigned int seed) {
+  srand(seed);
+  key_t *arr = calloc(n, sizeof(key_t));
+  key_t *sorted = calloc(n, sizeof(key_t));
+  key_t *res = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n / 2 + 1);
+  }
+
+  rbtree *t = new_rbtree();
+  assert(rbtree_set_insert_buffer(t, cap) == 0);
+  for (size_t i = 0; i < n; i++) {
+    node_t *p = rbtree_insert(t, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+    assert(t->ext->buf_n < cap);
+    assert(rbtree_find(t, arr[i]) != NULL);
+    if (i % 97 == 0) {
+      memcpy(sorted, arr, (i + 1) * sizeof(key_t));
+      qsort(sorted, i + 1, sizeof(key_t), comp);
+      check_buffered(t, sorted, res, i + 1);
+    }
+  }
+
+  // erase some keys that are still buffered and some that are in the tree
+  for (size_t i = 0; i < n; i += 3) {
+    node_t *p = rbtree_find(t, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+    assert(rbtree_erase(t, p) == 0);
+    arr[i] = -1;
+  }
+  size_t m = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (arr[i] >= 0) {
+      sorted[m++] = arr[i];
+    }
+  }
+  qsort(sorted, m, sizeof(key_t), comp);
+  check_buffered(t, sorted, res, m);
+
+  // fill the buffer part way, then clone and flush
+  rbtree_insert(t, -5);
+  rbtree_insert(t, n);
+  memmove(sorted + 1, sorted, m * sizeof(key_t));
+  sorted[0] = -5;
+  sorted[m + 1] = n;
+  m += 2;
+  assert(cap < 3 || t->ext->buf_n > 0);
+
+  rbtree *c = rbtree_clone(t);
+  assert(c->ext->buf_n == t->ext->buf_n && c->ext->buf_cap == cap);
+  check_buffered(c, sorted, res, m);
+
+  assert(rbtree_flush_buffer(t) == 0);
+  assert(t->ext->buf_n == 0);
+  check_buffered(t, sorted, res, m);
+  test_color_constraint(t);
+  test_search_constraint(t);
+
+  // relayout and disabling the buffer both merge pending nodes first
+  rbtree_insert(c, 0);
+  assert(rbtree_relayout(c) == 0 && c->ext->buf_n == 0);
+  assert(rbtree_set_insert_buffer(c, 0) == 0 && c->ext->buf == NULL);
+  assert(c->size == m + 1);
+  test_color_constraint(c);
+  test_search_constraint(c);
+
+  delete_rbtree(c);
+  delete_rbtree(t);
+
+  // lazy erase and batch insert on a buffered tree
+  t = new_rbtree();
+  rbtree_set_lazy_erase(t, 0.5);
+  rbtree_set_insert_buffer(t, cap);
+  const size_t k = cap / 2 + 1;
+  for (size_t i = 0; i < k; i++) {
+    rbtree_insert(t, i);
+  }
+  // a buffered node is removed at once instead of becoming a tombstone
+  node_t *p = rbtree_find(t, 0);
+  const bool was_buffered = p->buffered;
+  assert(rbtree_erase(t, p) == 0);
+  assert(!was_buffered || t->ext->dead == 0);
+  assert(rbtree_find(t, 0) == NULL);
+  const key_t batch[] = {3, 1, 2};
+  assert(rbtree_insert_batch(t, batch, 3) == 0);
+  assert(t->ext->buf_n == 0 && t->size - t->ext->dead == k - 1 + 3);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  delete_rbtree(t);
+
+  // auto-relayout moves every node; the node returned by rbtree_insert must
+  // still be the live one
+  t = new_rbtree();
+  rbtree_set_insert_buffer(t, cap);
+  rbtree_set_auto_relayout(t, 0.5);
+  for (size_t i = 0; i < 4 * cap + 50; i++) {
+    node_t *p = rbtree_insert(t, i);
+    assert(p->key == (key_t)i);
+    assert(rbtree_find(t, i) == p);
+  }
+  test_color_constraint(t);
+  test_search_constraint(t);
+  delete_rbtree(t);
+
+  free(res);
+  free(sorted);
+  free(arr);
+}
+
+// rbtree_memory_usage accounting, with per-node allocation and with nodes
+// carved out of huge-page blocks
+void test_memory_usage(const size_t n, const unsigned int seed) {
+  srand(seed);
+  key_t *arr = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (n + 1);
+  }
+
+  for (int huge = 0; huge < 2; huge++) {
+    rbtree *t = new_rbtree();
+    rbtree_set_huge_pages(t, huge);
+    rbtree_memory m = rbtree_memory_usage(t);
+    assert(m.live_nodes == 0 && m.used_bytes == 0 && m.reserved_bytes > 0);
+    const size_t empty = m.reserved_bytes;
+
+    insert_arr(t, arr, n);
+    test_color_constraint(t);
+    test_search_constraint(t);
+    m = rbtree_memory_usage(t);
+    assert(m.live_nodes == n && m.dead_nodes == 0 && m.free_nodes == 0);
+    assert(m.used_bytes == n * sizeof(node_t));
+    assert(m.reserved_bytes >= empty + m.used_bytes);
+    assert(m.fragmentation >= 0 && m.fragmentation < 1);
+    if (huge) {
+      assert(t->ext->blocks != NULL && m.huge_page_bytes > 0);
+      assert(m.huge_page_bytes % (2 << 20) == 0);
+    } else {
+      // a tree that uses none of the optional features has no ext
+      assert(t->ext == NULL);
+      assert(m.reserved_bytes == empty + m.used_bytes);
+      assert(m.huge_page_bytes == 0);
+    }
+
+    // freed block nodes stay reserved and are reused by later inserts
+    const size_t reserved = m.reserved_bytes;
+    for (size_t i = 0; i < n / 2; i++) {
+      assert(rbtree_erase(t, rbtree_find(t, arr[i])) == 0);
+    }
+    m = rbtree_memory_usage(t);
+    assert(m.live_nodes == n - n / 2);
+    assert(huge ? m.free_nodes == n / 2 && m.reserved_bytes == reserved
+                : m.free_nodes == 0 && m.reserved_bytes < reserved);
+    insert_arr(t, arr, n / 2);
+    m = rbtree_memory_usage(t);
+    assert(m.live_nodes == n && m.free_nodes == 0);
+    assert(!huge || m.reserved_bytes == reserved);
+
+    // tombstones are counted separately from live nodes
+    rbtree_set_lazy_erase(t, 0.9);
+    rbtree_erase(t, rbtree_min(t));
+    m = rbtree_memory_usage(t);
+    assert(m.live_nodes == n - 1 && m.dead_nodes == 1);
+    assert(m.used_bytes == n * sizeof(node_t));
+
+    // relayout moves every node into one exactly sized block
+    assert(rbtree_relayout(t) == 0);
+    m = rbtree_memory_usage(t);
+    assert(m.free_nodes == 0 && m.used_bytes == n * sizeof(node_t));
+    delete_rbtree(t);
+  }
+
+  rbtree *s = new_small_rbtree();
+  rbtree_insert(s, 1);
+  rbtree_memory m = rbtree_memory_usage(s);
+  assert(m.live_nodes == 1 && m.used_bytes == sizeof(node_t));
+  assert(m.reserved_bytes > m.used_bytes && m.huge_page_bytes == 0);
+  delete_rbtree(s);
+
+  free(arr);
+}
+
+// small trees keep keys in the header until they outgrow RBTREE_SMALL_MAX,
+// then behave like any other tree
+void test_small_rbtree(const unsigned int seed) {
+  srand(seed);
+  const size_t n = RBTREE_SMALL_MAX * 4;
+  key_t *arr = calloc(n, sizeof(key_t));
+  key_t *res = calloc(n, sizeof(key_t));
+  for (size_t i = 0; i < n; i++) {
+    arr[i] = rand() % (RBTREE_SMALL_MAX * 2);
+  }
+
+  rbtree *s = new_small_rbtree();
+  rbtree *other = new_small_rbtree();
+  assert(s != NULL && other != NULL && s != other);
+  assert(s->nil == other->nil && s->root == s->nil);
+  assert(rbtree_min(s) == NULL && rbtree_max(s) == NULL);
+
+  for (size_t i = 0; i < RBTREE_SMALL_MAX; i++) {
+    node_t *p = rbtree_insert(s, arr[i]);
+    assert(p != NULL && p->key == arr[i]);
+    assert(s->small != NULL && s->size == i + 1);
+  }
+  qsort(arr, RBTREE_SMALL_MAX, sizeof(key_t), comp);
+  rbtree_to_array(s, res, RBTREE_SMALL_MAX);
+  for (size_t i = 0; i < RBTREE_SMALL_MAX; i++) {
+    assert(res[i] == arr[i]);
+    assert(rbtree_find(s, arr[i]) != NULL);
+  }
+  assert(rbtree_min(s)->key == arr[0]);
+  assert(rbtree_max(s)->key == arr[RBTREE_SMALL_MAX - 1]);
+  assert(rbtree_find(s, -1) == NULL);
+
+  // erase and re-insert without leaving small mode
+  assert(rbtree_erase(s, rbtree_find(s, arr[3])) == 0);
+  assert(s->size == RBTREE_SMALL_MAX - 1);
+  rbtree_insert(s, arr[3]);
+
+  rbtree *c = rbtree_clone(s);
+  assert(c->small != NULL && c->size == s->size);
+  rbtree_to_array(c, res, RBTREE_SMALL_MAX);
+  for (size_t i = 0; i < RBTREE_SMALL_MAX; i++) {
+    assert(res[i] == arr[i]);
+  }
+
+  // the next insert promotes to a real red-black tree
+  rbtree_insert(s, arr[RBTREE_SMALL_MAX]);
+  assert(s->small == NULL && s->root != s->nil);
+  rbtree_insert_batch(s, arr + RBTREE_SMALL_MAX + 1, n - RBTREE_SMALL_MAX - 1);
+  assert(s->size == n);
+  test_color_constraint(s);
+  test_search_constraint(s);
+  qsort(arr, n, sizeof(key_t), comp);
+  rbtree_to_array(s, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(res[i] == arr[i]);
+  }
+
+  // a clone of a promoted small tree is a real tree as well
+  rbtree *pc = rbtree_clone(s);
+  assert(pc->small == NULL && pc->size == n && pc->nil == s->nil);
+  assert(same_shape(s->root, s->nil, pc->root, pc->nil));
+  test_color_constraint(pc);
+  test_search_constraint(pc);
+  rbtree_to_array(pc, res, n);
+  for (size_t i = 0; i < n; i++) {
+    assert(res[i] == arr[i]);
+    assert(rbtree_find(pc, arr[i]) != NULL);
+  }
+  rbtree_insert(pc, -1);
+  assert(rbtree_min(pc)->key == -1 && rbtree_min(s)->key == arr[0]);
+  delete_rbtree(pc);
+
+  for (size_t i = 0; i < n; i++) {
+    assert(rbtree_erase(s, rbtree_find(s, arr[i])) == 0);
+  }
+  assert(s->size == 0 && s->root == s->nil);
+
+  // a batch that does not fit promotes the clone as well
+  rbtree_insert_batch(c, arr, n);
+  assert(c->small == NULL && c->size == n + RBTREE_SMALL_MAX);
+  test_color_constraint(c);
+  test_search_constraint(c);
+
+  // the other tree is untouched by all of the above
+  assert(other->size == 0 && rbtree_min(other) == NULL);
+
+#ifdef RBTREE_AUGMENT
+  assert(rbtree_set_aggregate(other, rbtree_agg_max, -1) == -1);
+  for (size_t i = 0; i < RBTREE_SMALL_MAX; i++) {
+    rbtree_insert_value(other, i, 10 * i);
+  }
+  assert(rbtree_range_aggregate(other, 2, 4) == 20 + 30 + 40);
+  rbtree_insert_value(other, RBTREE_SMALL_MAX, 1);
+  assert(other->small == NULL);
+  assert(rbtree_range_aggregate(other, 2, 4) == 20 + 30 + 40);
+  assert(rbtree_range_aggregate(other, 0, RBTREE_SMALL_MAX) ==
+         10 * RBTREE_SMALL_MAX * (RBTREE_SMALL_MAX - 1) / 2 + 1);
+#endif
+
+  // headers are recycled through the pool
+  delete_rbtree(other);
+  rbtree *again = new_small_rbtree();
+  assert(again == other && again->size == 0 && again->small != NULL);
+
+  delete_rbtree(again);
+  delete_rbtree(c);
+  delete_rbtree(s);
+  free(res);
+  free(arr);
+}
+
+// node pointers from a small tree stay valid across inserts, erases and the
+// promotion to a real tree, like those of any other tree
+void test_small_rbtree_pointers(void) {
+  rbtree *t = new_small_rbtree();
+  node_t *one = rbtree_insert(t, 1);
+  node_t *zero = rbtree_insert(t, 0);
+  assert(one->key == 1 && zero->key == 0);
+  assert(rbtree_find(t, 1) == one && rbtree_min(t) == zero);
+
+  // a pointer to an erased slot is rejected, not taken as another key
+  assert(rbtree_erase(t, zero) == 0);
+  assert(one->key == 1 && rbtree_min(t) == one);
+  assert(rbtree_erase(t, zero) == -1 && t->size == 1);
+
+  node_t *p[RBTREE_SMALL_MAX * 2];
+  for (int i = 0; i < RBTREE_SMALL_MAX * 2; i++) {
+    p[i] = rbtree_insert(t, RBTREE_SMALL_MAX * 2 - i + 1);
+  }
+  assert(t->small == NULL && one->key == 1 && rbtree_min(t) == one);
+  for (int i = 0; i < RBTREE_SMALL_MAX * 2; i++) {
+    assert(p[i]->key == RBTREE_SMALL_MAX * 2 - i + 1);
+    assert(rbtree_find(t, p[i]->key) == p[i]);
+  }
+
+  // slots that became tree nodes are erased like any other node
+  assert(rbtree_erase(t, one) == 0);
+  for (int i = 0; i < RBTREE_SMALL_MAX * 2; i += 2) {
+    assert(rbtree_erase(t, p[i]) == 0);
+  }
+  assert(t->size == RBTREE_SMALL_MAX);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  rbtree_memory m = rbtree_memory_usage(t);
+  assert(m.live_nodes == RBTREE_SMALL_MAX);
+  assert(m.reserved_bytes >= m.used_bytes);
+
+  assert(rbtree_relayout(t) == 0 && t->size == RBTREE_SMALL_MAX);
+  test_color_constraint(t);
+  test_search_constraint(t);
+  delete_rbtree(t);
+}
+
+// each thread owns its small trees; they only share the pool and sentinel
+// returns the last tree so that the caller can check its colors
+static void *small_worker(void *arg) {
+  unsigned int seed = *(unsigned int *)arg;
+  const key_t range = RBTREE_SMALL_MAX * 4;
+  key_t res[2000];
+  rbtree *t = NULL;
+
+  for (int round = 0; round < 200; round++) {
+    delete_rbtree(t);
+    t = new_small_rbtree();
+    assert(t != NULL);
+    size_t count[RBTREE_SMALL_MAX * 4] = {0};
+    for (int i = 0; i < 2000; i++) {
+      const key_t key = rand_r(&seed) % range;
+      const int op = rand_r(&seed) % 3;
+      if (op == 0) {
+        assert(rbtree_insert(t, key)->key == key);
+        count[key]++;
+      } else {
+        node_t *p = rbtree_find(t, key);
+        assert((p != NULL) == (count[key] > 0));
+        if (p != NULL && op == 2) {
+          assert(p->key == key && rbtree_erase(t, p) == 0);
+          count[key]--;
+        }
+      }
+    }
+
+    rbtree_to_array(t, res, t->size);
+    size_t k = 0;
+    for (key_t key = 0; key < range; key++) {
+      for (size_t j = 0; j < count[key]; j++) {
+        assert(res[k++] == key);
+      }
+    }
+    assert(k == t->size);
+  }
+  return t;
+}
+
+// distinct small trees may be created, modified and deleted concurrently
+void test_small_rbtree_threads(void) {
+  pthread_t th[2];
+  unsigned int seeds[2] = {97, 101};
+
+  for (int i = 0; i < 2; i++) {
+    assert(pthread_create(&th[i], NULL, small_worker, &seeds[i]) == 0);
+  }
+  for (int i = 0; i < 2; i++) {
+    void *t;
+    assert(pthread_join(th[i], &t) == 0);
+    test_color_constraint(t);
+    test_search_constraint(t);
+    delete_rbtree(t);
+  }
+}
+
+#ifdef RBTREE_AUGMENT
+static agg_t brute_range(const key_t *keys, const agg_t *vals,
+                         const bool *alive, const size_t n, const key_t lo,
+                         const key_t hi, agg_combine_t combine,
+                         const agg_t identity) {
+  agg_t res = identity;
+  for (size_t i = 0; i < n; i++) {
+    if (alive[i] && lo <= keys[i] && keys[i] <= hi) {
+      res = combine(res, vals[i]);
+    }
+  }
+  return res;
+}
+
+static void check_range_queries(const rbtree *t, const key_t *keys,
+                                const agg_t *vals, const bool *alive,
+                                const size_t n) {
+  for (int i = 0; i < 200; i++) {
+    key_t lo = rand() % (n + 10) - 5;
+    key_t hi = lo + rand() % (n / 4 + 1);
+    assert(rbtree_range_aggregate(t, lo, hi) ==
+           brute_range(keys, vals, alive, n, lo, hi, t->combine, t->identity));
+  }
+}
+
+// range aggregate should match a brute-force scan after inserts and erases
+void test_range_aggregate(const size_t n, const unsigned int seed,
+                          const double lazy) {
+  srand(seed);
+  rbtree *t = new_rbtree();
+  rbtree_set_lazy_erase(t, lazy);
+  key_t *keys = calloc(n, sizeof(key_t));
+  agg_t *vals = calloc(n, sizeof(agg_t));
+  bool *alive = calloc(n, sizeof(bool));
+
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = i;
+  }
+  for (size_t i = n - 1; i > 0; i--) {
+    size_t j = rand() % (i + 1);
+    key_t tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+  for (size_t i = 0; i < n; i++) {
+    vals[i] = rand() % 1000;
+    alive[i] = true;
+    node_t *p = rbtree_insert_value(t, keys[i], vals[i]);
+    assert(p->key == keys[i]);
+  }
+  check_range_queries(t, keys, vals, alive, n);
+
+  for (size_t i = 0; i < n; i += 3) {
+    rbtree_erase(t, rbtree_find(t, keys[i]));
+    alive[i] = false;
+  }
+  test_color_constraint(t);
+  check_range_queries(t, keys, vals, alive, n);
+
+  rbtree_set_aggregate(t, rbtree_agg_max, -1);
+  check_range_queries(t, keys, vals, alive, n);
+  assert(rbtree_range_aggregate(t, 1, 0) == -1);
+
+  free(alive);
+  free(vals);
+  free(keys);
+  delete_rbtree(t);
+}
+#endif
+
 int main(void) {
   test_init();
   test_insert_single(1024);
@@ -379,5 +1200,25 @@ int main(void) {
   test_duplicate_values();
   test_multi_instance();
   test_find_erase_rand(10000, 17);
+  test_insert_returns_node();
+  test_insert_batch_suite();
+  test_lazy_erase();
+  test_clone(1, 59);
+  test_clone(5000, 61);
+  test_trace();
+  test_relayout(2, 67);
+  test_relayout(100000, 71);
+  test_tdrbtree(1, 47);
+  test_tdrbtree(10000, 53);
+  test_small_rbtree(73);
+  test_small_rbtree_pointers();
+  test_small_rbtree_threads();
+  test_insert_buffer(5000, 64, 79);
+  test_insert_buffer(1000, 1, 83);
+  test_memory_usage(100000, 89);
+#ifdef RBTREE_AUGMENT
+  test_range_aggregate(1000, 23, 0);
+  test_range_aggregate(1000, 29, 0.5);
+#endif
   printf("Passed all tests!\n");
 }